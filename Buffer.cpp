@@ -5,18 +5,26 @@
 #include <sys/uio.h>
 #include <string.h>
 #include <unistd.h>
-#include <strings.h>
 #include <sys/socket.h>
 
+// socketRead的第二块接收内存, 每个线程(EventLoop)一块, 所有连接共用, 不需要每次读数据时申请
+static thread_local char t_extraBuf[40960];
+
 Buffer::Buffer(int size):m_capacity(size)
 {
+    // 只读取写入过的数据, 不需要初始化
     m_data = (char*)malloc(size);
-    bzero(m_data, size);
+}
+
+Buffer::Buffer(char* storage, int size):m_capacity(size)
+{
+    m_data = storage;
+    m_ownsData = false;
 }
 
 Buffer::~Buffer()
 {
-    if (m_data != nullptr)
+    if (m_data != nullptr && m_ownsData)
     {
         free(m_data);
     }
@@ -35,8 +43,8 @@ void Buffer::extendRoom(int size)
     {
         // 得到未读的内存大小
         int readable = readableSize();
-        // 移动内存
-        memcpy(m_data, m_data + m_readPos, readable);
+        // 移动内存, 源和目标可能重叠
+        memmove(m_data, m_data + m_readPos, readable);
         // 更新位置
         m_readPos = 0;
         m_writePos = readable;
@@ -44,15 +52,30 @@ void Buffer::extendRoom(int size)
     // 3. 内存不够用 - 扩容
     else
     {
-        void* temp = realloc(m_data, m_capacity + size);
+        // 至少扩大一倍, 持续写入大量数据时不用每次都realloc
+        int capacity = m_capacity * 2;
+        if (capacity < m_writePos + size)
+        {
+            capacity = m_writePos + size;
+        }
+        void* temp = nullptr;
+        if (m_ownsData)
+        {
+            temp = realloc(m_data, capacity);
+        }
+        else if ((temp = malloc(capacity)) != nullptr)
+        {
+            // 外部提供的内存不能realloc, 申请新内存之后把数据拷贝过去
+            memcpy(temp, m_data, m_writePos);
+            m_ownsData = true;
+        }
         if (temp == NULL)
         {
             return; // 失败了
         }
-        memset((char*)temp + m_capacity, 0, size);
         // 更新数据
         m_data = static_cast<char*>(temp);
-        m_capacity += size;
+        m_capacity = capacity;
     }
 }
 
@@ -85,16 +108,20 @@ int Buffer::appendString(const string data)
 
 int Buffer::socketRead(int fd)
 {
-    // read/recv/readv
+    // read/recv/readv/recvmsg
     struct iovec vec[2];
     // 初始化数组元素
     int writeable = writeableSize();
     vec[0].iov_base = m_data + m_writePos;
     vec[0].iov_len = writeable;
-    char* tmpbuf = (char*)malloc(40960);
-    vec[1].iov_base = tmpbuf;
-    vec[1].iov_len = 40960;
-    int result = readv(fd, vec, 2);
+    vec[1].iov_base = t_extraBuf;
+    vec[1].iov_len = sizeof(t_extraBuf);
+    // 使用MSG_DONTWAIT非阻塞地读, 边沿触发模式下会一直读到返回-1(EAGAIN)为止
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = 2;
+    int result = recvmsg(fd, &msg, MSG_DONTWAIT);
     if (result == -1)
     {
         return -1;
@@ -105,17 +132,21 @@ int Buffer::socketRead(int fd)
     }
     else
     {
+        // 缓冲区放不下的部分先收到了线程的临时内存中, 扩容之后再拷贝回来
         m_writePos = m_capacity;
-        appendString(tmpbuf, result - writeable);
+        appendString(t_extraBuf, result - writeable);
     }
-    free(tmpbuf);
     return result;
 }
 
-char* Buffer::findCRLF()
+void Buffer::commitWrite(const char* target, int size)
 {
-    char* ptr = (char*)memmem(m_data + m_readPos, readableSize(), "\r\n", 2);
-    return ptr;
+    // 请求进行期间数据被读完时读写位置会归零, 这时把收到的数据移动到当前的写位置
+    if (target != m_data + m_writePos)
+    {
+        memmove(m_data + m_writePos, target, size);
+    }
+    m_writePos += size;
 }
 
 int Buffer::sendData(int socket)
@@ -128,7 +159,6 @@ int Buffer::sendData(int socket)
         if (count > 0)
         {
             m_readPos += count;
-            usleep(1);
         }
         return count;
     }
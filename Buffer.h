@@ -6,6 +6,8 @@ class Buffer
 {
 public:
     Buffer(int size);
+    // 使用外部提供的内存, 扩容时才改为自己申请的内存, storage由调用者管理
+    Buffer(char* storage, int size);
     ~Buffer();
 
     // 扩容
@@ -25,23 +27,36 @@ public:
     int appendString(const char* data);
     int appendString(const string data);
     int socketRead(int fd);
-    // 根据\r\n取出一行, 找到其在数据块中的位置, 返回该位置
-    char* findCRLF();
     // 发送数据
-    int sendData(int socket);    // 指向内存的指针
+    // 非阻塞地发送可读的数据, 返回发送的字节数, 发送缓冲区满时返回-1(EAGAIN)
+    int sendData(int socket);
     // 得到读数据的起始位置
     inline char* data()
     {
         return m_data + m_readPos;
     }
+    // 完成模式下由内核直接写入: 先保证至少有size字节的可写空间, 返回写入的位置, 请求完成之前不能再扩容
+    inline char* prepareWrite(int size)
+    {
+        extendRoom(size);
+        return m_data + m_writePos;
+    }
+    // 从prepareWrite()返回的位置写入了size字节
+    void commitWrite(const char* target, int size);
     inline int readPosIncrease(int count)
     {
         m_readPos += count;
+        // 数据全部读完之后从头开始使用内存, 长连接上的后续请求不需要移动内存
+        if (m_readPos == m_writePos)
+        {
+            m_readPos = m_writePos = 0;
+        }
         return m_readPos;
     }
 private:
     char* m_data;
     int m_capacity;
+    bool m_ownsData = true; // m_data是不是自己申请的内存
     int m_readPos = 0;
     int m_writePos = 0;
 };
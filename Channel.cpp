@@ -29,3 +29,20 @@ bool Channel::isWriteEventEnable()
 {
     return m_events & (int)FDEvent::WriteEvent;
 }
+
+void Channel::readEventEnable(bool flag)
+{
+    if (flag)
+    {
+        m_events |= static_cast<int>(FDEvent::ReadEvent);
+    }
+    else
+    {
+        m_events = m_events & ~(int)FDEvent::ReadEvent;
+    }
+}
+
+bool Channel::isReadEventEnable()
+{
+    return m_events & (int)FDEvent::ReadEvent;
+}
@@ -1,6 +1,8 @@
 #pragma once
 #include <functional>
 
+class Buffer;
+
 // 定义函数指针
 // typedef int(*handleFunc)(void* arg);
 // using handleFunc = int(*)(void*);
@@ -30,6 +32,9 @@ public:
     void writeEventEnable(bool flag);
     // 判断是否需要检测文件描述符的写事件
     bool isWriteEventEnable();
+    // 修改fd的读事件(检测 or 不检测)
+    void readEventEnable(bool flag);
+    bool isReadEventEnable();
     // 取出私有成员的值（接口）
     inline int getEvent()
     {
@@ -43,6 +48,34 @@ public:
     {
         return m_arg;
     }
+    // 完成模式(io_uring)下由dispatcher代替回调读写fd, 其他的dispatcher忽略这些设置
+    // 设置了读缓冲区的channel: 读回调被调用时数据已经接收到缓冲区中, channel需要有destroyCallback
+    inline void setReadBuffer(Buffer* buf)
+    {
+        m_readBuf = buf;
+    }
+    inline Buffer* getReadBuffer()
+    {
+        return m_readBuf;
+    }
+    // 监听的channel: 读回调被调用时已经accept了一个连接
+    inline void setAcceptor(bool flag)
+    {
+        m_acceptor = flag;
+    }
+    inline bool isAcceptor()
+    {
+        return m_acceptor;
+    }
+    // 完成模式下刚完成的操作的结果: 接收或者发送的字节数(接收到0表示对方断开了连接), 新连接的fd, 出错时为-errno
+    inline void setResult(int result)
+    {
+        m_result = result;
+    }
+    inline int getResult()
+    {
+        return m_result;
+    }
 private:
     // 文件描述符
     int m_fd; // 事件的文件描述符
@@ -50,5 +83,8 @@ private:
     int m_events;
     // 回调函数的参数
     void* m_arg;
+    Buffer* m_readBuf = nullptr;
+    bool m_acceptor = false;
+    int m_result = 0;
 };
 
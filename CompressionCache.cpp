@@ -0,0 +1,264 @@
+#include "CompressionCache.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <zlib.h>
+
+CompressionCache* CompressionCache::getInstance()
+{
+    static CompressionCache cache;
+    return &cache;
+}
+
+CompressionCache::CompressionCache()
+{
+    // 默认32MB
+    setCapacity(32 * 1024 * 1024);
+}
+
+CompressionCache::~CompressionCache()
+{
+    stop();
+}
+
+void CompressionCache::setCapacity(size_t bytes)
+{
+    m_shardCapacity = bytes / ShardCount;
+}
+
+void CompressionCache::start()
+{
+    if (EntryOverhead > m_shardCapacity || m_thread.joinable())
+    {
+        // 容量为0时不在线压缩, 不需要后台线程
+        return;
+    }
+    m_stopped = false;
+    m_thread = thread(&CompressionCache::compressLoop, this);
+}
+
+void CompressionCache::stop()
+{
+    {
+        lock_guard<mutex> locker(m_taskMutex);
+        m_stopped = true;
+        m_tasks.clear();
+    }
+    m_taskCond.notify_one();
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+}
+
+CompressionCache::Shard& CompressionCache::getShard(const CompressionKey& key)
+{
+    return m_shards[CompressionKeyHash()(key) % ShardCount];
+}
+
+bool CompressionCache::enqueue(const shared_ptr<CompressedEntry>& entry, const shared_ptr<const FileMeta>& meta)
+{
+    {
+        lock_guard<mutex> locker(m_taskMutex);
+        if (m_stopped || m_tasks.size() >= MaxPendingTasks)
+        {
+            return false;
+        }
+        m_tasks.push_back(Task{ entry, meta });
+    }
+    m_taskCond.notify_one();
+    return true;
+}
+
+void CompressionCache::compressLoop()
+{
+    while (true)
+    {
+        Task task;
+        {
+            unique_lock<mutex> locker(m_taskMutex);
+            m_taskCond.wait(locker, [this]() { return m_stopped || !m_tasks.empty(); });
+            if (m_stopped)
+            {
+                return;
+            }
+            task = move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        CompressedEntry* entry = task.entry.get();
+        Shard& shard = getShard(entry->key);
+        bool cached;
+        {
+            // 排队期间已经被淘汰的就不用再压缩了
+            shared_lock<shared_mutex> locker(shard.mutex);
+            auto it = shard.entries.find(entry->key);
+            cached = it != shard.entries.end() && it->second.get() == entry;
+        }
+        if (cached)
+        {
+            // 压缩时不持有锁, 完成之后再把实际的大小计入容量
+            compress(entry, task.meta.get());
+        }
+        unique_lock<shared_mutex> locker(shard.mutex);
+        if (cached)
+        {
+            account(shard, entry);
+        }
+        // 发布压缩的结果, 读到ready之后才能访问data和beneficial
+        entry->ready.store(true, memory_order_release);
+    }
+}
+
+void CompressionCache::compress(CompressedEntry* entry, const FileMeta* meta)
+{
+    // 用pread读到内存中再压缩, 不使用mmap: 文件在压缩期间被其他进程截断时, 访问映射的内存会收到SIGBUS
+    // 文件的大小不超过MaxSourceSize, 缓冲区的大小是有上限的
+    size_t size = meta->st.st_size;
+    string src(size, '\0');
+    size_t total = 0;
+    while (total < size)
+    {
+        ssize_t len = pread(meta->fd, &src[total], size - total, total);
+        if (len == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len <= 0)
+        {
+            // 出错或者文件变短了, 直接发送原文件
+            return;
+        }
+        total += len;
+    }
+    // windowBits加16时输出gzip格式, 否则是http中deflate编码使用的zlib格式
+    int windowBits = entry->key.encoding == ContentEncoding::Gzip ? 15 + 16 : 15;
+    z_stream stream = {};
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return;
+    }
+    // deflateBound给出的大小一定能放下压缩结果, 一次调用就能完成
+    entry->data.resize(deflateBound(&stream, size));
+    stream.next_in = reinterpret_cast<Bytef*>(&src[0]);
+    stream.avail_in = size;
+    stream.next_out = reinterpret_cast<Bytef*>(&entry->data[0]);
+    stream.avail_out = entry->data.size();
+    int ret = deflate(&stream, Z_FINISH);
+    size_t outSize = stream.total_out;
+    deflateEnd(&stream);
+    // 压缩之后没有变小(例如已经压缩过的数据)就直接发送原文件
+    if (ret != Z_STREAM_END || outSize >= size)
+    {
+        string().swap(entry->data);
+        return;
+    }
+    entry->data.resize(outSize);
+    entry->data.shrink_to_fit();
+    entry->beneficial = true;
+}
+
+void CompressionCache::removeEntry(Shard& shard, size_t index)
+{
+    shared_ptr<CompressedEntry> entry = shard.ring[index];
+    shard.entries.erase(entry->key);
+    shard.usedBytes -= entry->accounted;
+    shard.ring[index] = shard.ring.back();
+    shard.ring[index]->ringIndex = index;
+    shard.ring.pop_back();
+}
+
+void CompressionCache::evict(Shard& shard, size_t size)
+{
+    while (!shard.ring.empty() && shard.usedBytes + size > m_shardCapacity)
+    {
+        if (shard.hand >= shard.ring.size())
+        {
+            shard.hand = 0;
+        }
+        // 最近被访问过的缓存项再给一次机会
+        if (shard.ring[shard.hand]->referenced.exchange(false))
+        {
+            ++shard.hand;
+            continue;
+        }
+        removeEntry(shard, shard.hand);
+    }
+}
+
+void CompressionCache::account(Shard& shard, CompressedEntry* entry)
+{
+    // 压缩期间可能已经被淘汰了
+    auto it = shard.entries.find(entry->key);
+    if (it == shard.entries.end() || it->second.get() != entry)
+    {
+        return;
+    }
+    size_t size = entry->data.size();
+    if (size + EntryOverhead > m_shardCapacity)
+    {
+        // 压缩结果太大放不进缓存, 保留一个不使用压缩的标记, 之后的请求直接发送原文件, 不会反复压缩
+        string().swap(entry->data);
+        entry->beneficial = false;
+        return;
+    }
+    evict(shard, size);
+    it = shard.entries.find(entry->key);
+    if (it != shard.entries.end() && it->second.get() == entry)
+    {
+        shard.usedBytes += size;
+        entry->accounted += size;
+    }
+}
+
+shared_ptr<const CompressedEntry> CompressionCache::lookup(const shared_ptr<const FileMeta>& meta, ContentEncoding encoding)
+{
+    if (encoding == ContentEncoding::Identity || meta->fd == -1 ||
+        meta->st.st_size == 0 || meta->st.st_size > MaxSourceSize || EntryOverhead > m_shardCapacity)
+    {
+        return nullptr;
+    }
+    CompressionKey key{ meta->st.st_dev, meta->st.st_ino, meta->st.st_size,
+        meta->st.st_mtim.tv_sec * 1000000000LL + meta->st.st_mtim.tv_nsec, encoding };
+    Shard& shard = getShard(key);
+    shared_ptr<CompressedEntry> entry;
+    {
+        shared_lock<shared_mutex> locker(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end())
+        {
+            entry = it->second;
+            entry->referenced.store(true, memory_order_relaxed);
+        }
+    }
+    if (entry == nullptr)
+    {
+        unique_lock<shared_mutex> locker(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end())
+        {
+            entry = it->second;
+        }
+        else
+        {
+            // 插入一个还没有压缩的缓存项交给后台线程, 并发的未命中不会重复提交
+            entry = make_shared<CompressedEntry>();
+            entry->key = key;
+            if (!enqueue(entry, meta))
+            {
+                return nullptr;
+            }
+            evict(shard, EntryOverhead);
+            entry->accounted = EntryOverhead;
+            entry->ringIndex = shard.ring.size();
+            shard.ring.push_back(entry);
+            shard.entries.emplace(key, entry);
+            shard.usedBytes += EntryOverhead;
+        }
+    }
+    // 压缩完成之前先发送原文件
+    if (!entry->ready.load(memory_order_acquire) || !entry->beneficial)
+    {
+        return nullptr;
+    }
+    return entry;
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include "FileCache.h"
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+using namespace std;
+
+// 响应体的编码方式
+enum class ContentEncoding:char
+{
+    Identity,
+    Gzip,
+    Deflate
+};
+
+// 文件的标识: 文件被修改之后mtime或者size会变化, 旧的压缩结果不会再被使用
+struct CompressionKey
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    int64_t mtimeNs;
+    ContentEncoding encoding;
+    bool operator==(const CompressionKey& other) const
+    {
+        return dev == other.dev && ino == other.ino && size == other.size &&
+            mtimeNs == other.mtimeNs && encoding == other.encoding;
+    }
+};
+struct CompressionKeyHash
+{
+    size_t operator()(const CompressionKey& key) const
+    {
+        size_t h = hash<ino_t>()(key.ino);
+        h = h * 31 + hash<int64_t>()(key.mtimeNs);
+        h = h * 31 + hash<off_t>()(key.size);
+        h = h * 31 + static_cast<size_t>(key.encoding);
+        return h ^ hash<dev_t>()(key.dev);
+    }
+};
+
+// 压缩之后的文件内容
+struct CompressedEntry
+{
+    CompressionKey key;
+    string data;
+    bool beneficial = false;    // 压缩成功并且比原文件小
+    atomic<bool> ready{ false };    // 后台线程压缩完成之后才能读取data和beneficial
+    atomic<bool> referenced{ true };
+    size_t ringIndex = 0;
+    size_t accounted = 0;       // 已经计入分片容量的字节数
+};
+
+// 压缩结果的缓存: 同一个文件的同一种编码只压缩一次, 总大小不超过容量, 按CLOCK算法淘汰
+// 压缩在单独的后台线程中进行, 不阻塞反应堆, 压缩完成之前的请求直接发送原文件
+class CompressionCache
+{
+public:
+    static const int ShardCount = 8;
+    // 超过这个大小的文件不在线压缩(占用后台线程太久), 可以提供预先压缩的.gz文件
+    static const off_t MaxSourceSize = 2 * 1024 * 1024;
+    // 排队等待压缩的文件数的上限, 队列满时这次请求直接发送原文件
+    static const size_t MaxPendingTasks = 64;
+
+    static CompressionCache* getInstance();
+    // 设置缓存的总容量(字节), 需要在服务器启动之前设置
+    void setCapacity(size_t bytes);
+    // 启动后台压缩线程, 线程会继承调用者的信号屏蔽字和cpu亲和性, 需要在屏蔽信号之后, 绑定cpu之前调用
+    // 没有启动时不在线压缩, 只使用预先压缩好的.gz文件
+    void start();
+    // 等待正在进行的压缩完成, 丢弃还在排队的任务
+    void stop();
+    // 得到文件按encoding压缩之后的内容, 不能压缩, 压缩之后没有变小或者还没有压缩完时返回nullptr
+    // 第一次未命中时提交给后台线程压缩, 不会阻塞调用者
+    shared_ptr<const CompressedEntry> lookup(const shared_ptr<const FileMeta>& meta, ContentEncoding encoding);
+
+private:
+    CompressionCache();
+    ~CompressionCache();
+    struct Task
+    {
+        shared_ptr<CompressedEntry> entry;
+        // 持有文件的描述符, 压缩期间文件从缓存中删除也能继续读取
+        shared_ptr<const FileMeta> meta;
+    };
+    struct Shard
+    {
+        shared_mutex mutex;
+        unordered_map<CompressionKey, shared_ptr<CompressedEntry>, CompressionKeyHash> entries;
+        vector<shared_ptr<CompressedEntry>> ring;
+        size_t hand = 0;
+        size_t usedBytes = 0;
+    };
+    static void compress(CompressedEntry* entry, const FileMeta* meta);
+    // 后台线程的任务函数
+    void compressLoop();
+    // 提交压缩任务, 任务队列已满或者后台线程没有运行时返回false
+    bool enqueue(const shared_ptr<CompressedEntry>& entry, const shared_ptr<const FileMeta>& meta);
+    Shard& getShard(const CompressionKey& key);
+    // 压缩完成之后才知道实际的大小, 需要持有分片的写锁
+    void account(Shard& shard, CompressedEntry* entry);
+    void removeEntry(Shard& shard, size_t index);
+    void evict(Shard& shard, size_t size);
+
+private:
+    static const size_t EntryOverhead = 256;
+    Shard m_shards[ShardCount];
+    size_t m_shardCapacity;
+    thread m_thread;
+    mutex m_taskMutex;
+    condition_variable m_taskCond;
+    deque<Task> m_tasks;
+    bool m_stopped = true;
+};
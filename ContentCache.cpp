@@ -0,0 +1,185 @@
+#include "ContentCache.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+ContentEntry::~ContentEntry()
+{
+    if (data == nullptr)
+    {
+        return;
+    }
+    if (mapped)
+    {
+        munmap(data, size);
+    }
+    else
+    {
+        free(data);
+    }
+}
+
+ContentCache* ContentCache::getInstance()
+{
+    static ContentCache cache;
+    return &cache;
+}
+
+ContentCache::ContentCache()
+{
+    // 默认64MB
+    setCapacity(64 * 1024 * 1024);
+}
+
+void ContentCache::setCapacity(size_t bytes)
+{
+    m_capacity = bytes;
+    // 每个分片单独计算容量, 淘汰时只需要锁住一个分片
+    m_shardCapacity = bytes / ShardCount;
+}
+
+void ContentCache::load(ContentEntry* entry, const FileMeta* meta)
+{
+    size_t size = meta->st.st_size;
+    if (size >= SmallFileSize)
+    {
+        // 大文件映射到内存, 由内核的页缓存提供数据, 不额外占用内存(仍然按文件大小计入容量, 见ContentCache.h)
+        void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, meta->fd, 0);
+        if (ptr == MAP_FAILED)
+        {
+            perror("mmap");
+            return;
+        }
+        entry->data = static_cast<char*>(ptr);
+        entry->mapped = true;
+        entry->loaded = true;
+        return;
+    }
+    // 小文件一次读到连续的内存中, 缓存的fd是共用的, 使用pread指定偏移量
+    char* buf = static_cast<char*>(malloc(size));
+    if (buf == nullptr)
+    {
+        return;
+    }
+    size_t offset = 0;
+    while (offset < size)
+    {
+        ssize_t len = pread(meta->fd, buf + offset, size - offset, offset);
+        if (len > 0)
+        {
+            offset += len;
+        }
+        else if (len == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            // 读取失败或者文件被截断了
+            free(buf);
+            return;
+        }
+    }
+    entry->data = buf;
+    entry->loaded = true;
+}
+
+void ContentCache::removeEntry(Shard& shard, size_t index)
+{
+    shared_ptr<ContentEntry> entry = shard.ring[index];
+    shard.entries.erase(entry->key);
+    shard.usedBytes -= entry->size + EntryOverhead;
+    // 用最后一个元素填补空位
+    shard.ring[index] = shard.ring.back();
+    shard.ring[index]->ringIndex = index;
+    shard.ring.pop_back();
+    // 正在发送的响应还持有entry, 发送完之后才会释放内存
+}
+
+void ContentCache::evict(Shard& shard, size_t size)
+{
+    while (!shard.ring.empty() && shard.usedBytes + size > m_shardCapacity)
+    {
+        if (shard.hand >= shard.ring.size())
+        {
+            shard.hand = 0;
+        }
+        ContentEntry* entry = shard.ring[shard.hand].get();
+        // 最近被访问过的缓存项再给一次机会, 清除标记后跳过
+        if (entry->referenced.exchange(false) && !entry->meta.expired())
+        {
+            ++shard.hand;
+            continue;
+        }
+        removeEntry(shard, shard.hand);
+    }
+}
+
+shared_ptr<const ContentEntry> ContentCache::lookup(const shared_ptr<const FileMeta>& meta)
+{
+    size_t size = meta->st.st_size;
+    // 文件为空、太大或者不能缓存时返回nullptr, 由调用者使用sendfile发送
+    // 元数据没有被缓存时每次都是新的对象, 缓存内容也不会命中
+    if (meta->fd == -1 || size == 0 || size + EntryOverhead > m_shardCapacity ||
+        !FileCache::getInstance()->isWatching())
+    {
+        return nullptr;
+    }
+    const FileMeta* key = meta.get();
+    Shard& shard = getShard(key);
+    shared_ptr<ContentEntry> entry;
+    {
+        // 命中时只加分片的读锁
+        shared_lock<shared_mutex> locker(shard.mutex);
+        auto it = shard.entries.find(key);
+        // 地址相同但是weak_ptr已经失效, 说明是旧的元数据被释放之后地址被重新使用了
+        if (it != shard.entries.end() && it->second->meta.lock() == meta)
+        {
+            entry = it->second;
+            entry->referenced.store(true, memory_order_relaxed);
+        }
+    }
+    if (entry == nullptr)
+    {
+        unique_lock<shared_mutex> locker(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end() && it->second->meta.lock() == meta)
+        {
+            // 其他线程刚刚插入了
+            entry = it->second;
+        }
+        else
+        {
+            if (it != shard.entries.end())
+            {
+                removeEntry(shard, it->second->ringIndex);
+            }
+            evict(shard, size + EntryOverhead);
+            // 先插入一个还没有读取内容的缓存项, 并发的未命中都会找到它, 由call_once保证只读取一次
+            entry = make_shared<ContentEntry>();
+            entry->meta = meta;
+            entry->key = key;
+            entry->size = size;
+            entry->ringIndex = shard.ring.size();
+            shard.ring.push_back(entry);
+            shard.entries.emplace(key, entry);
+            shard.usedBytes += size + EntryOverhead;
+        }
+    }
+    // 读取文件时不持有锁, 其他线程在这里等待同一次读取的结果
+    call_once(entry->loadOnce, load, entry.get(), meta.get());
+    if (!entry->loaded)
+    {
+        // 读取失败的缓存项不能留在缓存中, 否则在被淘汰之前这个文件一直无法缓存, 下一个请求重新读取
+        unique_lock<shared_mutex> locker(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end() && it->second == entry)
+        {
+            removeEntry(shard, entry->ringIndex);
+        }
+        return nullptr;
+    }
+    return entry;
+}
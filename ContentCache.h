@@ -0,0 +1,83 @@
+#pragma once
+#include "FileCache.h"
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <stddef.h>
+#include <stdint.h>
+using namespace std;
+
+// 缓存的文件内容, 创建之后只读, 发送时作为内存片段直接使用
+struct ContentEntry
+{
+    ContentEntry() = default;
+    ContentEntry(const ContentEntry&) = delete;
+    ContentEntry& operator=(const ContentEntry&) = delete;
+    ~ContentEntry();
+    // 内容对应的文件元数据, 文件变化之后FileCache中的元数据会被替换, 这里的weak_ptr随之失效
+    weak_ptr<const FileMeta> meta;
+    // 并发未命中时只有一个线程读取文件, 其他线程等待结果
+    once_flag loadOnce;
+    char* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;    // data是mmap得到的
+    bool loaded = false;    // 读取成功
+    // CLOCK算法的访问标记, 命中时只修改这个标记, 不需要写锁
+    atomic<bool> referenced{ true };
+    const FileMeta* key = nullptr;  // 在所属分片的哈希表中的key
+    size_t ringIndex = 0;           // 在所属分片的环中的下标
+};
+
+// 静态文件内容的内存缓存, 总大小不超过容量, 按CLOCK算法淘汰
+// 小文件拷贝到连续的内存中, 大文件使用mmap映射, 超过上限的文件不缓存, 继续使用sendfile发送
+// 以FileCache返回的FileMeta为key, 文件变化之后FileMeta被替换, 旧的内容自然不会再命中
+class ContentCache
+{
+public:
+    static const int ShardCount = 16;
+    // 小于这个大小的文件拷贝到申请的内存中, 否则使用mmap
+    static const size_t SmallFileSize = 64 * 1024;
+
+    static ContentCache* getInstance();
+    // 设置缓存的总容量(字节), 为0时不缓存, 需要在服务器启动之前设置
+    // 每个文件按完整的大小计入容量, 包括mmap映射的大文件: 映射的页属于页缓存, 只有被访问过的页占用物理内存,
+    // 内存紧张时内核可以回收, 所以实际占用的内存可能小于容量; 容量限制的是映射的地址空间和可能常驻的数据量的上限
+    void setCapacity(size_t bytes);
+    inline size_t getCapacity()
+    {
+        return m_capacity;
+    }
+    // 查找文件的内容, 不能缓存或者读取失败时返回nullptr
+    shared_ptr<const ContentEntry> lookup(const shared_ptr<const FileMeta>& meta);
+
+private:
+    ContentCache();
+    struct Shard
+    {
+        shared_mutex mutex;
+        unordered_map<const FileMeta*, shared_ptr<ContentEntry>> entries;
+        vector<shared_ptr<ContentEntry>> ring;  // CLOCK的环
+        size_t hand = 0;        // CLOCK的指针
+        size_t usedBytes = 0;
+    };
+    // 每个缓存项额外占用的内存, 避免大量小文件超出预算
+    static const size_t EntryOverhead = 256;
+    static void load(ContentEntry* entry, const FileMeta* meta);
+    // 从环和哈希表中删除一个缓存项, 需要持有分片的写锁
+    void removeEntry(Shard& shard, size_t index);
+    // 淘汰缓存项直到能再放下size字节, 需要持有分片的写锁
+    void evict(Shard& shard, size_t size);
+    inline Shard& getShard(const FileMeta* key)
+    {
+        // 对象的地址是按16字节对齐的, 去掉低位之后再分片
+        return m_shards[(reinterpret_cast<uintptr_t>(key) >> 4) % ShardCount];
+    }
+
+private:
+    Shard m_shards[ShardCount];
+    size_t m_capacity;
+    size_t m_shardCapacity;
+};
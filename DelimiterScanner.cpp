@@ -0,0 +1,98 @@
+#include "DelimiterScanner.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// 程序启动时根据CPU选择一次, 之后直接通过函数指针调用
+DelimiterScanner::ScanFunc DelimiterScanner::m_impl = DelimiterScanner::selectImpl();
+
+static inline bool isDelimiter(char c)
+{
+    return c == '\r' || c == '\n' || c == ':';
+}
+
+// 把一个块中的匹配结果(每一位对应一个字节)转换成位置
+static inline void appendMask(uint32_t mask, uint32_t offset, DelimiterList& positions)
+{
+    while (mask != 0)
+    {
+        positions.push_back(offset + __builtin_ctz(mask));
+        // 清除最低位的1
+        mask &= mask - 1;
+    }
+}
+
+void DelimiterScanner::scan(const char* data, int size, uint32_t base, DelimiterList& positions)
+{
+    if (size > 0)
+    {
+        m_impl(data, size, base, positions);
+    }
+}
+
+void DelimiterScanner::scanScalar(const char* data, int size, uint32_t base, DelimiterList& positions)
+{
+    for (int i = 0; i < size; ++i)
+    {
+        if (isDelimiter(data[i]))
+        {
+            positions.push_back(base + i);
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void DelimiterScanner::scanSse2(const char* data, int size, uint32_t base, DelimiterList& positions)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i colon = _mm_set1_epi8(':');
+    int i = 0;
+    // 每次比较16个字节, 三个比较结果合并之后用一个掩码表示
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i match = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)),
+            _mm_cmpeq_epi8(chunk, colon));
+        appendMask(static_cast<uint32_t>(_mm_movemask_epi8(match)), base + i, positions);
+    }
+    // 不足16个字节的尾部
+    scanScalar(data + i, size - i, base + i, positions);
+}
+
+__attribute__((target("avx2")))
+void DelimiterScanner::scanAvx2(const char* data, int size, uint32_t base, DelimiterList& positions)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i colon = _mm256_set1_epi8(':');
+    int i = 0;
+    // 每次比较32个字节
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i match = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, cr), _mm256_cmpeq_epi8(chunk, lf)),
+            _mm256_cmpeq_epi8(chunk, colon));
+        appendMask(static_cast<uint32_t>(_mm256_movemask_epi8(match)), base + i, positions);
+    }
+    // 剩下的数据交给SSE2处理
+    scanSse2(data + i, size - i, base + i, positions);
+}
+#endif
+
+DelimiterScanner::ScanFunc DelimiterScanner::selectImpl()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return scanAvx2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return scanSse2;
+    }
+#endif
+    return scanScalar;
+}
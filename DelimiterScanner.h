@@ -0,0 +1,28 @@
+#pragma once
+#include "SmallVector.h"
+#include <stdint.h>
+using namespace std;
+
+// 分隔符的位置, 一般的请求头只有几十个分隔符, 不需要申请内存
+using DelimiterList = SmallVector<uint32_t, 128>;
+
+// 一次遍历找出数据中所有 '\r' '\n' ':' 的位置, 供http解析器使用
+// 根据CPU支持的指令集在运行时选择AVX2、SSE2或者逐字节查找的实现
+class DelimiterScanner
+{
+public:
+    // 在[data, data + size)中查找分隔符, 把 base + 偏移量 依次追加到positions中
+    static void scan(const char* data, int size, uint32_t base, DelimiterList& positions);
+
+private:
+    using ScanFunc = void (*)(const char* data, int size, uint32_t base, DelimiterList& positions);
+    static void scanScalar(const char* data, int size, uint32_t base, DelimiterList& positions);
+#if defined(__x86_64__) || defined(__i386__)
+    static void scanSse2(const char* data, int size, uint32_t base, DelimiterList& positions);
+    static void scanAvx2(const char* data, int size, uint32_t base, DelimiterList& positions);
+#endif
+    static ScanFunc selectImpl();
+
+private:
+    static ScanFunc m_impl;
+};
@@ -0,0 +1,189 @@
+#include "DirListingCache.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <charconv>
+#include <mutex>
+
+DirListingCache* DirListingCache::getInstance()
+{
+    static DirListingCache cache;
+    return &cache;
+}
+
+shared_ptr<const string> DirListingCache::lookup(const char* path, const shared_ptr<const FileMeta>& meta)
+{
+    // 每个线程重复使用同一个key, 不需要每次申请内存
+    static thread_local string key;
+    key.assign(path);
+    bool watching = FileCache::getInstance()->isWatching();
+    {
+        shared_lock<shared_mutex> locker(m_mutex);
+        auto it = m_entries.find(key);
+        if (it != m_entries.end())
+        {
+            Entry& entry = it->second;
+            if (entry.dev == meta->st.st_dev && entry.ino == meta->st.st_ino &&
+                entry.mtime.tv_sec == meta->st.st_mtim.tv_sec && entry.mtime.tv_nsec == meta->st.st_mtim.tv_nsec &&
+                (!watching || entry.meta.lock() == meta))
+            {
+                entry.referenced.store(true, memory_order_relaxed);
+                return entry.html;
+            }
+        }
+    }
+    // 在锁外读取目录, 同时未命中的线程各自生成一次, 结果相同
+    shared_ptr<const string> html = render(path);
+    if (html == nullptr)
+    {
+        return nullptr;
+    }
+    unique_lock<shared_mutex> locker(m_mutex);
+    auto it = m_entries.find(key);
+    if (it == m_entries.end())
+    {
+        // 满了之后只淘汰一个最近没有被访问过的目录, 遍历大量目录时常用的页面还能留在缓存中
+        evict();
+        it = m_entries.try_emplace(key).first;
+        it->second.ringIndex = m_ring.size();
+        m_ring.push_back(&*it);
+    }
+    // 已经存在的缓存项是过期的页面, 直接替换内容
+    Entry& entry = it->second;
+    entry.dev = meta->st.st_dev;
+    entry.ino = meta->st.st_ino;
+    entry.mtime = meta->st.st_mtim;
+    entry.meta = meta;
+    entry.html = html;
+    return html;
+}
+
+void DirListingCache::removeEntry(size_t index)
+{
+    EntryMap::value_type* node = m_ring[index];
+    // 用最后一个元素填补空位
+    m_ring[index] = m_ring.back();
+    m_ring[index]->second.ringIndex = index;
+    m_ring.pop_back();
+    // 正在发送的响应还持有html, 发送完之后才会释放
+    m_entries.erase(m_entries.find(node->first));
+}
+
+void DirListingCache::evict()
+{
+    while (!m_ring.empty() && m_ring.size() >= MaxEntries)
+    {
+        if (m_hand >= m_ring.size())
+        {
+            m_hand = 0;
+        }
+        // 最近被访问过的目录再给一次机会, 清除标记后跳过
+        if (m_ring[m_hand]->second.referenced.exchange(false))
+        {
+            ++m_hand;
+            continue;
+        }
+        removeEntry(m_hand);
+    }
+}
+
+shared_ptr<const string> DirListingCache::render(const char* path)
+{
+    int dirFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd == -1)
+    {
+        perror("open dir");
+        return nullptr;
+    }
+    struct dirent** namelist;
+    int num = scandirat(dirFd, ".", &namelist, NULL, alphasort);
+    if (num == -1)
+    {
+        perror("scandirat");
+        close(dirFd);
+        return nullptr;
+    }
+    auto html = make_shared<string>();
+    html->reserve(128 + num * 96);
+    html->append("<html><head><title>");
+    appendHtmlEscaped(*html, path);
+    html->append("</title></head><body><table>");
+    char number[32];
+    for (int i = 0; i < num; ++i)
+    {
+        // 取出文件名 namelist 指向的是一个指针数组 struct dirent* tmp[]
+        const char* name = namelist[i]->d_name;
+        struct stat st;
+        // 相对于目录的fd获取属性, 内核不需要每次重新解析目录的路径
+        if (fstatat(dirFd, name, &st, 0) == 0)
+        {
+            // a标签 <a href="">name</a>
+            html->append("<tr><td><a href=\"");
+            appendUrlEncoded(*html, name);
+            if (S_ISDIR(st.st_mode))
+            {
+                html->push_back('/');
+            }
+            html->append("\">");
+            appendHtmlEscaped(*html, name);
+            html->append("</a></td><td>");
+            char* end = to_chars(number, number + sizeof(number), static_cast<long long>(st.st_size)).ptr;
+            html->append(number, end - number);
+            html->append("</td></tr>");
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+    close(dirFd);
+    html->append("</table></body></html>");
+    return html;
+}
+
+void DirListingCache::appendHtmlEscaped(string& html, string_view text)
+{
+    for (char c : text)
+    {
+        switch (c)
+        {
+        case '&':
+            html.append("&amp;");
+            break;
+        case '<':
+            html.append("&lt;");
+            break;
+        case '>':
+            html.append("&gt;");
+            break;
+        case '"':
+            html.append("&quot;");
+            break;
+        case '\'':
+            html.append("&#39;");
+            break;
+        default:
+            html.push_back(c);
+        }
+    }
+}
+
+void DirListingCache::appendUrlEncoded(string& html, string_view text)
+{
+    // 只保留不需要编码的字符, 其余的(包括中文的UTF-8字节)写成 %XX, 请求时由decodeMsg还原
+    static const char hex[] = "0123456789ABCDEF";
+    for (unsigned char c : text)
+    {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+        {
+            html.push_back(c);
+        }
+        else
+        {
+            html.push_back('%');
+            html.push_back(hex[c >> 4]);
+            html.push_back(hex[c & 0xf]);
+        }
+    }
+}
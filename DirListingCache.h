@@ -0,0 +1,55 @@
+#pragma once
+#include "FileCache.h"
+#include <string>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <sys/stat.h>
+using namespace std;
+
+// 目录列表页面的缓存: 以目录的路径为key, 目录的修改时间不变时直接使用生成好的页面
+// 目录中增加、删除、重命名文件都会修改目录的mtime, 之后的请求重新生成页面
+class DirListingCache
+{
+public:
+    // 最多缓存的目录个数, 满了之后按CLOCK算法淘汰
+    static const int MaxEntries = 64;
+
+    static DirListingCache* getInstance();
+    // 得到目录的列表页面, meta是path对应的目录的元数据, 打不开目录时返回nullptr
+    shared_ptr<const string> lookup(const char* path, const shared_ptr<const FileMeta>& meta);
+
+private:
+    DirListingCache() = default;
+    struct Entry
+    {
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime;
+        // 监视目录时, 目录中的文件被修改(mtime不变)也会替换目录的FileMeta, 页面中的大小随之更新
+        weak_ptr<const FileMeta> meta;
+        shared_ptr<const string> html;
+        // CLOCK算法的访问标记, 命中时只修改这个标记, 不需要写锁
+        atomic<bool> referenced{ true };
+        size_t ringIndex = 0;   // 在环中的下标
+    };
+    using EntryMap = unordered_map<string, Entry>;
+    // 读取目录并生成页面, 只遍历一次目录
+    static shared_ptr<const string> render(const char* path);
+    // 把名字转义之后追加到html中, 一个用于显示, 一个用于链接
+    static void appendHtmlEscaped(string& html, string_view text);
+    static void appendUrlEncoded(string& html, string_view text);
+    // 从环和哈希表中删除一个缓存项, 需要持有写锁
+    void removeEntry(size_t index);
+    // 淘汰缓存项直到能再放下一个目录, 需要持有写锁
+    void evict();
+
+private:
+    shared_mutex m_mutex;
+    EntryMap m_entries;
+    // CLOCK的环, 哈希表的节点在删除之前地址不变, 直接保存节点的指针
+    vector<EntryMap::value_type*> m_ring;
+    size_t m_hand = 0;  // CLOCK的指针
+};
@@ -1,4 +1,5 @@
 #include "Dispatcher.h"
+#include <unistd.h>
 
 Dispatcher::Dispatcher(EventLoop* evloop) : m_evLoop(evloop)
 {
@@ -27,3 +28,17 @@ int Dispatcher::dispatch(int timeout)
 {
     return 0;
 }
+
+int Dispatcher::sendMsg(const struct msghdr* msg)
+{
+    return -1;
+}
+
+void Dispatcher::closeFd(int fd)
+{
+    close(fd);
+}
+
+void Dispatcher::flush()
+{
+}
@@ -2,6 +2,7 @@
 #include "Channel.h"
 #include "EventLoop.h"
 #include <string>
+#include <sys/socket.h>
 using namespace std;
 
 // Dispatcher类和EvenLoop类是互相包含的，所以这里需要对EventLoop进行声明
@@ -20,13 +21,25 @@ public:
     // 修改
     virtual int modify();
     // 事件监测
-    virtual int dispatch(int timeout = 2); // 单位: s
+    virtual int dispatch(int timeout = -1); // 单位: ms, -1表示一直等待
+    // 完成模式下提交m_channel的sendmsg请求, 完成之后调用写回调; 不支持时返回-1
+    virtual int sendMsg(const struct msghdr* msg);
+    // 关闭已经删除的fd, 完成模式下和其他请求一起提交
+    virtual void closeFd(int fd);
+    // 提交还没有提交的请求, 不等待完成; 反应堆退出之前调用
+    virtual void flush();
     inline void setChannel(Channel* channel)
     {
         m_channel = channel;
     }
+    // 是否由dispatcher直接完成读写(io_uring), 否则只通知fd的读写事件
+    inline bool isCompletionBased()
+    {
+        return m_completionBased;
+    }
     protected:
     string m_name = string();
+    bool m_completionBased = false;
     Channel* m_channel;
     EventLoop* m_evLoop;
 };
\ No newline at end of file
@@ -3,9 +3,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
 #include "EpollDispatcher.h"
 
-EpollDispatcher::EpollDispatcher(EventLoop* evloop) : Dispatcher(evloop)
+EpollDispatcher::EpollDispatcher(EventLoop* evloop, bool edgeTriggered) : Dispatcher(evloop)
 {
     m_epfd = epoll_create(10); // 创建epoll的事件监听表
     if (m_epfd == -1)
@@ -13,14 +14,14 @@ EpollDispatcher::EpollDispatcher(EventLoop* evloop) : Dispatcher(evloop)
         perror("epoll_create");
         exit(0);
     }
-    m_events = new struct epoll_event[m_maxNode];
-    m_name = "Epoll";
+    m_edgeTriggered = edgeTriggered;
+    m_events.resize(m_initNode);
+    m_name = edgeTriggered ? "EpollET" : "Epoll";
 }
 
 EpollDispatcher::~EpollDispatcher()
 {
     close(m_epfd);
-    delete[]m_events;
 }
 
 int EpollDispatcher::add()
@@ -43,8 +44,11 @@ int EpollDispatcher::remove()
         perror("epoll_crl delete");
         exit(0);
     }
-    // 通过 channel 释放对应的 TcpConnection 资源
-    m_channel->destroyCallback(const_cast<void*>(m_channel->getArg()));
+    // 通过 channel 释放对应的 TcpConnection 资源, 没有destroyCallback的channel由EventLoop释放
+    if (m_channel->destroyCallback)
+    {
+        m_channel->destroyCallback(const_cast<void*>(m_channel->getArg()));
+    }
 
     return ret;
 }
@@ -62,16 +66,25 @@ int EpollDispatcher::modify()
 
 int EpollDispatcher::dispatch(int timeout)
 {
-    int count = epoll_wait(m_epfd, m_events, m_maxNode, timeout * 1000);
+    int count = epoll_wait(m_epfd, m_events.data(), m_events.size(), timeout);
+    if (count == -1)
+    {
+        if (errno == EINTR)
+        {
+            return 0;
+        }
+        perror("epoll_wait");
+        exit(0);
+    }
     for (int i = 0; i < count; ++i)
     {
         int events = m_events[i].events;
         int fd = m_events[i].data.fd;
         if (events & EPOLLERR || events & EPOLLHUP)
         {
-            // 对方断开了连接, 删除 fd
-            // epollRemove(Channel, evLoop);
-            continue;
+            // 对方断开了连接或者出错, 交给读回调处理, read会返回0或-1, 由读回调删除 fd
+            // 如果直接跳过, 水平触发模式下这个fd会被反复报告
+            events |= EPOLLIN;
         }
         if (events & EPOLLIN)
         {
@@ -82,6 +95,11 @@ int EpollDispatcher::dispatch(int timeout)
             m_evLoop->eventActive(fd, (int)FDEvent::WriteEvent);
         }
     }
+    // 事件数组被填满了, 说明可能还有就绪的fd没有取出来, 扩容后下一轮可以一次取完
+    if (count == (int)m_events.size())
+    {
+        m_events.resize(m_events.size() * 2);
+    }
     return 0;
 }
 
@@ -98,6 +116,10 @@ int EpollDispatcher::epollCtl(int op)
     {
         events |= EPOLLOUT;
     }
+    if (m_edgeTriggered)
+    {
+        events |= EPOLLET;
+    }
     ev.events = events;
     // m_epfd是成员变量
     int ret = epoll_ctl(m_epfd, op, m_channel->getSocket(), &ev);
@@ -4,12 +4,14 @@
 #include "Dispatcher.h"
 #include <string>
 #include <sys/epoll.h>
+#include <vector>
 using namespace std;
 
 class EpollDispatcher : public Dispatcher // Dispatcher类的子类
 {
 public:
-    EpollDispatcher(EventLoop* evloop);
+    // edgeTriggered == true 时使用边沿触发模式（EPOLLET）
+    EpollDispatcher(EventLoop* evloop, bool edgeTriggered = false);
     ~EpollDispatcher();
     // 添加
     int add() override; // override是C++11的关键字，表示其父类对应的方法是个虚函数，子类需要重写这个方法
@@ -18,7 +20,7 @@ public:
     // 修改
     int modify() override;
     // 事件监测
-    int dispatch(int timeout = 2) override; // 单位: s
+    int dispatch(int timeout = -1) override; // 单位: ms, -1表示一直等待
 
 private:
     int epollCtl(int op);
@@ -26,6 +28,8 @@ private:
 private:
     // epoll的相关操作
     int m_epfd;
-    struct epoll_event* m_events;
-    const int m_maxNode = 520;
+    bool m_edgeTriggered;
+    // 存放epoll_wait返回的就绪事件，一次被填满时自动扩容，没有固定的上限
+    vector<struct epoll_event> m_events;
+    const int m_initNode = 512;
 };
\ No newline at end of file
@@ -1,46 +1,94 @@
 #include "EventLoop.h"
 #include <assert.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "SelectDispatcher.h"
 #include "PollDispatcher.h"
 #include "EpollDispatcher.h"
+#include "IoUringDispatcher.h"
+
+// 单调时钟的当前时刻, 单位是us
+static uint64_t nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 // 构造函数，string()表示空字符串，调用下面的有参构造函数，初始化threadName为空字符串
 EventLoop::EventLoop() : EventLoop(string())
 {
 }
 
-EventLoop::EventLoop(const string threadName)
+EventLoop::EventLoop(const string threadName, DispatcherType type)
 {
     m_isQuit = true; // 默认没有启动（退出状态）
     m_threadID = this_thread::get_id(); // 获取当前线程的线程id
     // string()返回空字符串，下面判断threadName是否是个空字符串
     m_threadName = threadName == string() ? "MainThread" : threadName;
     // m_dispatcher是个父类指针，之后可以基于指向不同的子类EpollDispatcher|PollDispatcher|SelectDispathcer实现多态的效果
-    m_dispatcher = new SelectDispatcher(this); // 这里指向SelectDispatcher，传入当前反应堆对象的this指针
-    // map
-    m_channelMap.clear(); // 初始化map
-    // 创建一个双向通信的管道，管道两端的文件描述符存放在m_socketPair[0],m_socketPair[1]
-    int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, m_socketPair);
-    if (ret == -1)
-    {
-        perror("socketpair");
+    // 根据启动时选择的type创建对应的子类对象，传入当前反应堆对象的this指针
+    m_dispatcherType = type;
+    switch (type)
+    {
+    case DispatcherType::Select:
+        m_dispatcher = new SelectDispatcher(this);
+        break;
+    case DispatcherType::Poll:
+        m_dispatcher = new PollDispatcher(this);
+        break;
+    case DispatcherType::Epoll:
+        m_dispatcher = new EpollDispatcher(this);
+        break;
+    case DispatcherType::IoUring:
+    {
+        IoUringDispatcher* dispatcher = new IoUringDispatcher(this);
+        if (dispatcher->isValid())
+        {
+            m_dispatcher = dispatcher;
+            break;
+        }
+        // 连接根据isCompletionBased()选择读写方式, 改用水平触发的epoll不需要其他处理
+        delete dispatcher;
+        printf("io_uring is not available, using epoll\n");
+        m_dispatcherType = DispatcherType::Epoll;
+        m_dispatcher = new EpollDispatcher(this);
+        break;
+    }
+    case DispatcherType::EpollET:
+    default:
+        m_dispatcher = new EpollDispatcher(this, true);
+        break;
+    }
+    m_completionBased = m_dispatcher->isCompletionBased();
+    // fd是从小到大分配的, 预留一部分记录, 不够用时在add()中扩容
+    m_channels.resize(1024);
+    // 创建一个eventfd，其他线程通过向它写入一个计数来唤醒阻塞在dispatch()中的反应堆
+    // eventfd内部只有一个64位的计数器，多次写入会被合并，一次read就能全部读出
+    m_wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeupFd == -1)
+    {
+        perror("eventfd");
         exit(0);
     }
+    m_wakeupPending = false;
+    m_shutdownDeadline = UINT64_MAX;
+    m_connectionCount = 0;
+    m_pendingBytes = 0;
+    m_busyTime = 0;
 #if 0
-    // 指定规则: evLoop->socketPair[0] 发送数据, evLoop->socketPair[1] 接收数据
     // readLocalMessage是个静态成员函数
-    Channel* channel = new Channel(m_socketPair[1], FDEvent::ReadEvent,
+    Channel* channel = new Channel(m_wakeupFd, FDEvent::ReadEvent,
         readLocalMessage, nullptr, nullptr, this);
 #else
     // 绑定 - bind，让可调用对象可以像函数一样被使用
     auto obj = bind(&EventLoop::readMessage, this);
-    // 指定规则: evLoop->socketPair[0] 发送数据, evLoop->socketPair[1] 接收数据
-    Channel* channel = new Channel(m_socketPair[1], FDEvent::ReadEvent,
+    Channel* channel = new Channel(m_wakeupFd, FDEvent::ReadEvent,
         obj, nullptr, nullptr, this);
 #endif
     // channel 添加到任务队列
@@ -50,6 +98,18 @@ EventLoop::EventLoop(const string threadName)
 // 析构函数
 EventLoop::~EventLoop()
 {
+    // 反应堆已经退出, 先处理还留在任务队列中的任务, 再释放剩下的channel: 连接、监听fd和eventfd
+    processTaskQ();
+    for (int fd = 0; fd < (int)m_channels.size(); ++fd)
+    {
+        Channel* channel = m_channels[fd].channel;
+        if (channel != nullptr)
+        {
+            remove(channel);
+        }
+    }
+    delete m_dispatcher;
+    delete m_connectionPool.load();
 }
 
 int EventLoop::run()
@@ -67,16 +127,107 @@ int EventLoop::run()
         // 对于发生的事件，dispatch()中会更具事件的类型，通过传入的当前反应堆对象的this指针，调用其eventActive()方法对其进行具体处理
         // 即所谓的分配（dispatch）
         // 如果超时，则不会调用eventActive()对任务进行处理
-        m_dispatcher->dispatch(); // 超时时长默认为2s，这个调用是个多态，实际调用的dispatch方法在子类中
+        // 超时时长是距离最近的定时器到期的时间，没有定时器时一直等待到有事件发生或者被唤醒
+        m_eventStart = 0;
+        // 还有上一轮没有处理完的事件时不阻塞
+        int timeout = m_pendingEvents.empty() ? getDispatchTimeout() : 0;
+        m_dispatcher->dispatch(timeout); // 这个调用是个多态，实际调用的dispatch方法在子类中
+        processPendingEvents();
+        // 处理事件的时间从第一个事件开始计算, 没有事件时从dispatch返回开始计算
+        uint64_t start = m_eventStart != 0 ? m_eventStart : nowUs();
 
         // processTaskQ()会从任务队列m_taskQ中取出任务结点node，从node中拿出channel
         // 根据channel对应的任务类型，分别调用add()|remove()|modify()，将channel中的m_fd添加（例如）到m_dispatch的监听事件表中
         // 例如调用add()，则将channel对象中的m_fd注册到SelectDispatcher对象的监听表m_readSet或m_writeSet中
         processTaskQ();
+        // 触发到期的定时器, 例如断开超时的连接
+        m_timerWheel.expire();
+        updateBusyTime(start);
+        // 收到了停止的请求, 连接都断开之后退出
+        if (checkShutdown())
+        {
+            m_isQuit = true;
+        }
     }
+    // 关闭fd的请求可能还在io_uring的提交队列中, 退出之前提交, 对方可以马上看到连接关闭
+    m_dispatcher->flush();
     return 0;
 }
 
+void EventLoop::shutdown(int timeoutMs)
+{
+    uint64_t deadline = TimerWheel::nowMs() + max(timeoutMs, 0);
+    uint64_t current = m_shutdownDeadline.load();
+    while (deadline < current && !m_shutdownDeadline.compare_exchange_weak(current, deadline))
+    {
+    }
+    // 反应堆可能阻塞在dispatch()中, 唤醒之后由run()处理
+    taskWakeup();
+}
+
+bool EventLoop::checkShutdown()
+{
+    uint64_t deadline = m_shutdownDeadline.load();
+    if (deadline == UINT64_MAX)
+    {
+        return false;
+    }
+    // 触发所有连接的定时器, 由连接根据自己的状态决定是立即断开还是处理完当前的请求再断开
+    if (m_drainState == DrainState::None)
+    {
+        m_drainState = DrainState::Draining;
+        m_timerWheel.expireAll();
+    }
+    if (m_drainState == DrainState::Draining && TimerWheel::nowMs() >= deadline)
+    {
+        m_drainState = DrainState::Closing;
+        m_timerWheel.expireAll();
+    }
+    return getConnectionCount() == 0;
+}
+
+int EventLoop::getDispatchTimeout()
+{
+    int timeout = m_timerWheel.getTimeout();
+    if (m_drainState != DrainState::Draining)
+    {
+        return timeout;
+    }
+    uint64_t now = TimerWheel::nowMs();
+    uint64_t deadline = m_shutdownDeadline.load();
+    int remaining = deadline > now ? (int)min<uint64_t>(deadline - now, INT32_MAX) : 0;
+    return timeout < 0 ? remaining : min(timeout, remaining);
+}
+
+void EventLoop::processPendingEvents()
+{
+    if (m_pendingEvents.empty())
+    {
+        return;
+    }
+    // 回调中可能再次添加, 留到下一轮处理
+    m_pendingEvents.swap(m_readyEvents);
+    for (PendingEvent& item : m_readyEvents)
+    {
+        // fd已经被释放(可能又分配给了新的连接), 或者已经不再检测这个事件了
+        if (findChannel(item.fd) == nullptr || getGeneration(item.fd) != item.generation ||
+            !(m_channels[item.fd].events & item.events))
+        {
+            continue;
+        }
+        eventActive(item.fd, item.events);
+    }
+    m_readyEvents.clear();
+}
+
+void EventLoop::updateBusyTime(uint64_t startUs)
+{
+    // 指数加权平均, 新的一轮占1/8, 偶尔一次耗时的循环不会让负载剧烈变化
+    int busy = (int)min<uint64_t>(nowUs() - startUs, INT32_MAX / 8);
+    int average = m_busyTime.load(memory_order_relaxed);
+    m_busyTime.store(average + (busy - average) / 8, memory_order_relaxed);
+}
+
 // 根据事件event的类型，对fd进行处理
 // 在m_dispatcher->dispatch()中被调用
 int EventLoop::eventActive(int fd, int event)
@@ -86,8 +237,18 @@ int EventLoop::eventActive(int fd, int event)
         return -1;
     }
     // 取出channel
-    Channel* channel = m_channelMap[fd]; // 获取fd对应的channel
+    Channel* channel = findChannel(fd); // 获取fd对应的channel
+    if (channel == nullptr)
+    {
+        // 同一轮的读回调中已经释放了这个channel
+        return -1;
+    }
     assert(channel->getSocket() == fd);
+    if (m_eventStart == 0)
+    {
+        m_eventStart = nowUs();
+    }
+    uint32_t generation = getGeneration(fd);
     // &是位运算，&&是逻辑运算
     // readCallback和writeCallback是在 TcpServer::run() 中创建channel时传入的
     if (event & (int)FDEvent::ReadEvent && channel->readCallback) // 处理读事件
@@ -97,6 +258,11 @@ int EventLoop::eventActive(int fd, int event)
         // 在readCallback()函数内部，void*类型的arg又会被重新转换成TcpServer*类型的指针，指向它对应的TcpServer对象
         channel->readCallback(const_cast<void*>(channel->getArg()));
     }
+    // 读回调中可能已经断开并释放了连接, channel的内存也可能已经被新的连接重新使用
+    if (getGeneration(fd) != generation)
+    {
+        return 0;
+    }
     if (event & (int)FDEvent::WriteEvent && channel->writeCallback) // 处理写事件
     {
         channel->writeCallback(const_cast<void*>(channel->getArg()));
@@ -113,12 +279,8 @@ int EventLoop::addTask(Channel* channel, ElemType type)
 {
     // 加锁, 保护共享资源
     m_mutex.lock();
-    // 创建新节点，封装channel和type
-    ChannelElement* node = new ChannelElement;
-    node->channel = channel;
-    node->type = type;
-    // 添加结点到任务队列中
-    m_taskQ.push(node);
+    // 创建新节点，封装channel和type，添加结点到任务队列中
+    m_taskQ.push_back(ChannelElement{ type, channel });
     m_mutex.unlock();
     // 处理节点
     /*
@@ -148,47 +310,88 @@ int EventLoop::addTask(Channel* channel, ElemType type)
 // 例如调用add()，则将channel对象中的m_fd注册到SelectDispatcher对象的监听表m_readSet或m_writeSet中
 int EventLoop::processTaskQ()
 {
-    // 取出头结点
-    while (!m_taskQ.empty())
+    // 先清除唤醒标记再取任务, 之后添加的任务会重新唤醒反应堆, 不会被遗漏
+    m_wakeupPending.store(false);
+    // 处理任务时又添加了任务(同一线程的addTask会调用到这里), 由外层的循环继续处理
+    if (m_isProcessing)
+    {
+        return 0;
+    }
+    m_isProcessing = true;
+    while (true)
     {
+        // 加锁后一次取出全部的任务, 锁只保护一次swap
         m_mutex.lock();
-        ChannelElement* node = m_taskQ.front(); // 取出一个任务结点
-        m_taskQ.pop();  // 删除节点
-        m_mutex.unlock(); // 解锁
-        Channel* channel = node->channel; // 取出channel
-        // 根据type判断需要处理的操作
-        if (node->type == ElemType::ADD)
+        if (m_taskQ.empty() && m_timerQ.empty())
         {
-            // 添加
-            add(channel);
+            m_mutex.unlock();
+            break;
         }
-        else if (node->type == ElemType::DELETE)
+        m_taskQ.swap(m_readyQ);
+        m_timerQ.swap(m_readyTimerQ);
+        m_mutex.unlock(); // 解锁
+        for (ChannelElement& node : m_readyQ)
         {
-            // 删除
-            remove(channel);
+            Channel* channel = node.channel; // 取出channel
+            // 根据type判断需要处理的操作
+            if (node.type == ElemType::ADD)
+            {
+                // 添加
+                add(channel);
+            }
+            else if (node.type == ElemType::DELETE)
+            {
+                // 删除
+                remove(channel);
+            }
+            else if (node.type == ElemType::MODIFY)
+            {
+                // 修改
+                modify(channel);
+            }
         }
-        else if (node->type == ElemType::MODIFY)
+        m_readyQ.clear(); // clear()不会释放容量
+        for (TimerElement& node : m_readyTimerQ)
         {
-            // 修改
-            modify(channel);
+            m_timerWheel.add(node.timer, node.timeoutMs);
         }
-        delete node;
+        m_readyTimerQ.clear();
     }
+    m_isProcessing = false;
     return 0;
 }
 
 int EventLoop::add(Channel* channel)
 {
     int fd = channel->getSocket();
+    if (fd >= (int)m_channels.size())
+    {
+        m_channels.resize(max(fd + 1, (int)m_channels.size() * 2));
+    }
     // 找到fd对应的数组元素位置, 并存储
-    if (m_channelMap.find(fd) == m_channelMap.end())
+    ChannelRecord& record = m_channels[fd];
+    if (record.channel == nullptr)
     {
-        m_channelMap.insert(make_pair(fd, channel));
+        record.channel = channel;
+        record.events = channel->getEvent();
         // 先设置m_dispatcher的m_channel = channel
         m_dispatcher->setChannel(channel); // setChannel的声明在父类头文件中，将channel指针传递给成员m_channel
         // 然后调用m_dispatcher->add(), 将m_channel的fd，根据对应的事件类型，注册到m_readSet或m_writeSet中
         int ret = m_dispatcher->add();
         // 添加成功ret==0，失败ret==-1
+        if (ret == -1)
+        {
+            // 注册失败(例如select的fd超过了上限): 撤销记录, 之后的remove()和modify()不会再操作dispatcher
+            record.channel = nullptr;
+            record.events = 0;
+            ++record.generation;
+            // 连接在这里释放并关闭fd, 否则客户端会一直等待; 其他的channel由创建者处理
+            if (channel->destroyCallback)
+            {
+                channel->destroyCallback(const_cast<void*>(channel->getArg()));
+                close(fd);
+            }
+        }
         return ret;
     }
     return -1;
@@ -197,22 +400,30 @@ int EventLoop::add(Channel* channel)
 int EventLoop::remove(Channel* channel)
 {
     int fd = channel->getSocket();
-    if (m_channelMap.find(fd) == m_channelMap.end())
+    if (findChannel(fd) != channel)
     {
         return -1;
     }
+    // 连接的channel在destroyCallback中和连接一起释放, 之后不能再访问channel
+    bool owned = !channel->destroyCallback;
     m_dispatcher->setChannel(channel);
     int ret = m_dispatcher->remove();
+    if (owned)
+    {
+        freeChannel(channel);
+        delete channel;
+    }
     return ret;
 }
 
 int EventLoop::modify(Channel* channel)
 {
     int fd = channel->getSocket();
-    if (m_channelMap.find(fd) == m_channelMap.end())
+    if (findChannel(fd) != channel)
     {
         return -1;
     }
+    m_channels[fd].events = channel->getEvent();
     m_dispatcher->setChannel(channel);
     int ret = m_dispatcher->modify();
     return ret;
@@ -221,33 +432,82 @@ int EventLoop::modify(Channel* channel)
 int EventLoop::readLocalMessage(void* arg)
 {
     EventLoop* evLoop = static_cast<EventLoop*>(arg);
-    char buf[256];
-    read(evLoop->m_socketPair[1], buf, sizeof(buf));
-    return 0;
+    return evLoop->readMessage();
 }
 
 void EventLoop::taskWakeup()
 {
-    const char* msg = "我是要成为海贼王的男人!!!";
-    write(m_socketPair[0], msg, strlen(msg));
+    // 反应堆已经被唤醒但还没有处理任务队列, 不需要再写一次
+    if (m_wakeupPending.exchange(true))
+    {
+        return;
+    }
+    uint64_t one = 1;
+    write(m_wakeupFd, &one, sizeof(one));
 }
 
 int EventLoop::freeChannel(Channel* channel)
 {
     // 删除 channel 和 fd 的对应关系
-    auto it = m_channelMap.find(channel->getSocket());
-    if (it != m_channelMap.end())
+    int fd = channel->getSocket();
+    if (findChannel(fd) == channel)
     {
-        m_channelMap.erase(it);
-        close(channel->getSocket());
-        delete channel;
+        ChannelRecord& record = m_channels[fd];
+        record.channel = nullptr;
+        record.events = 0;
+        ++record.generation;
+        m_dispatcher->closeFd(fd);
     }
     return 0;
 }
 
+int EventLoop::sendMsg(Channel* channel, const struct msghdr* msg)
+{
+    if (findChannel(channel->getSocket()) != channel)
+    {
+        return -1;
+    }
+    m_dispatcher->setChannel(channel);
+    return m_dispatcher->sendMsg(msg);
+}
+
+MemoryPool* EventLoop::getConnectionPool(size_t blockSize)
+{
+    MemoryPool* pool = m_connectionPool.load(memory_order_acquire);
+    if (pool != nullptr)
+    {
+        return pool;
+    }
+    // 连接可能在主线程中创建, 也可能在当前线程中创建, 只有第一次创建内存池时加锁
+    lock_guard<mutex> locker(m_mutex);
+    pool = m_connectionPool.load(memory_order_relaxed);
+    if (pool == nullptr)
+    {
+        pool = new MemoryPool(blockSize);
+        pool->setNumaNode(m_numaNode);
+        m_connectionPool.store(pool, memory_order_release);
+    }
+    return pool;
+}
+
+void EventLoop::addTimer(Timer* timer, int timeoutMs)
+{
+    // 时间轮只在反应堆的线程中访问, 不需要加锁
+    if (m_threadID == this_thread::get_id())
+    {
+        m_timerWheel.add(timer, timeoutMs);
+        return;
+    }
+    m_mutex.lock();
+    m_timerQ.push_back(TimerElement{ timer, timeoutMs });
+    m_mutex.unlock();
+    taskWakeup();
+}
+
 int EventLoop::readMessage()
 {
-    char buf[256];
-    read(m_socketPair[1], buf, sizeof(buf));
+    // 一次read就会把计数器清零, 边沿触发模式下也不需要循环读取
+    uint64_t count = 0;
+    read(m_wakeupFd, &count, sizeof(count));
     return 0;
 }
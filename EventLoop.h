@@ -1,10 +1,13 @@
 #pragma once
 #include "Dispatcher.h"
 #include "Channel.h"
+#include "MemoryPool.h"
+#include "TimerWheel.h"
 #include <thread>
-#include <queue>
-#include <map>
+#include <vector>
 #include <mutex>
+#include <atomic>
+#include <stdint.h>
 using namespace std;
 
 // 处理该节点中的channel的方式（指定了强类型枚举，类型为char；默认的int类型占4个字节，char只占1个字节，可以节省空间）
@@ -15,6 +18,46 @@ struct ChannelElement
     ElemType type; // 如何处理该节点中的channel，type==ADD,DEKETE,MODIFY
     Channel* channel;
 };
+// 其他线程添加的定时器, 和任务一起交给反应堆的线程处理
+struct TimerElement
+{
+    Timer* timer;
+    int timeoutMs;
+};
+
+// fd对应的记录，以fd为下标存放在EventLoop::m_channels中
+struct ChannelRecord
+{
+    Channel* channel = nullptr; // 为nullptr表示这个fd没有被注册
+    int events = 0;             // 注册到dispatcher中的事件
+    uint32_t generation = 0;    // fd每被释放一次加1，用于识别已经失效的事件
+};
+
+// 回调要求在下一轮循环中再次触发的事件
+struct PendingEvent
+{
+    int fd;
+    int events;
+    uint32_t generation; // 添加时fd的generation, 不同时说明fd已经被释放了
+};
+
+// 反应堆使用的IO多路复用模型，在程序启动时选择
+enum class DispatcherType:char
+{
+    Select,     // select，fd的上限为1024
+    Poll,       // poll
+    Epoll,      // epoll，水平触发（LT）
+    EpollET,    // epoll，边沿触发（ET），回调函数需要一直读到EAGAIN为止，或者通过activateLater()在下一轮继续读
+    IoUring     // io_uring，连接的收发和accept、close都作为请求批量提交，内核不支持时改用epoll
+};
+
+// 反应堆停止时的状态
+enum class DrainState:char
+{
+    None,       // 正常运行
+    Draining,   // 空闲的连接立即断开, 正在处理请求的连接发送完响应之后断开
+    Closing     // 超过了期限, 剩下的连接全部断开
+};
 
 // Dispatcher类和EvenLoop类是互相包含的，所以这里需要对Dispatcher进行声明
 class Dispatcher;
@@ -23,10 +66,14 @@ class EventLoop
 {
 public:
     EventLoop();
-    EventLoop(const string threadName);
+    // type指定反应堆使用的IO多路复用模型
+    EventLoop(const string threadName, DispatcherType type = DispatcherType::EpollET);
     ~EventLoop();
-    // 启动反应堆模型
+    // 启动反应堆模型, 调用shutdown()之后所有的连接都断开时返回
     int run();
+    // 停止反应堆, 可以在其他线程中调用: 已经建立的连接在timeoutMs毫秒内处理完当前的请求之后断开, 超过期限强制断开
+    // 多次调用时以最早的期限为准
+    void shutdown(int timeoutMs);
     // 处理被激活的文件描述符，event为FDEvent枚举类型，为TimeOut|ReadEvent|WriteEvent
     int eventActive(int fd, int event);
     // 添加任务channel到任务队列m_Qtask
@@ -35,10 +82,27 @@ public:
     int processTaskQ();
     // processTaskQ()根据任务的类型ADD, DELETE, MODIFY分别调用下面的三个函数处理任务
     int add(Channel* channel);
+    // 没有destroyCallback的channel(监听fd、eventfd等)在删除时关闭fd并释放channel对象, 它们必须是new出来的
     int remove(Channel* channel);
     int modify(Channel* channel);
-    // 释放channel
+    // 删除channel和fd的对应关系并关闭fd, channel对象由调用者释放
     int freeChannel(Channel* channel);
+    // 当前反应堆上的连接共用的内存池, 第一次调用时按blockSize创建
+    MemoryPool* getConnectionPool(size_t blockSize);
+    // timeoutMs毫秒之后在反应堆的线程中调用timer的回调, 已经添加过的定时器重新计时
+    // 可以在其他线程中调用, 这时由反应堆的线程在处理任务队列时添加
+    void addTimer(Timer* timer, int timeoutMs);
+    // 在下一轮循环中再次触发fd的events事件, 不等待内核的通知, 只能在反应堆的线程中调用
+    // 边沿触发模式下回调为了不让一个连接占满反应堆, 没有读到EAGAIN就返回时使用, 这时dispatch不会阻塞
+    inline void activateLater(int fd, int events)
+    {
+        m_pendingEvents.push_back(PendingEvent{ fd, events, getGeneration(fd) });
+    }
+    // 删除定时器, 只能在反应堆的线程中调用
+    inline void removeTimer(Timer* timer)
+    {
+        m_timerWheel.remove(timer);
+    }
     int readMessage(); //待定
     // 返回线程ID
     inline thread::id getThreadID()
@@ -49,22 +113,125 @@ public:
     {
         return m_threadName;
     }
+    // 反应堆的线程绑定的cpu所在的NUMA节点, 连接的内存池从这个节点上申请内存, -1表示没有绑定
+    inline void setNumaNode(int node)
+    {
+        m_numaNode = node;
+    }
+    inline int getNumaNode()
+    {
+        return m_numaNode;
+    }
+    // 只能在反应堆的线程中调用
+    inline DrainState getDrainState()
+    {
+        return m_drainState;
+    }
+    inline bool isDraining()
+    {
+        return m_drainState != DrainState::None;
+    }
+    // 负载信息: 由连接和反应堆的线程更新, 线程池在主线程中读取后决定新连接放到哪个反应堆, 只需要大致准确
+    // 当前反应堆上的连接数, 连接对象创建时(可能在主线程中)就计入, 不用等反应堆处理添加的任务
+    inline int getConnectionCount()
+    {
+        return m_connectionCount.load(memory_order_relaxed);
+    }
+    // 所有连接还没有发送出去的响应数据(包括文件)的字节数
+    inline long getPendingBytes()
+    {
+        return m_pendingBytes.load(memory_order_relaxed);
+    }
+    // 最近每轮循环处理事件、任务和定时器花费的时间(us), 不包括阻塞等待的时间
+    inline int getBusyTime()
+    {
+        return m_busyTime.load(memory_order_relaxed);
+    }
+    inline void updateConnectionCount(int delta)
+    {
+        m_connectionCount.fetch_add(delta, memory_order_relaxed);
+    }
+    inline void updatePendingBytes(long delta)
+    {
+        m_pendingBytes.fetch_add(delta, memory_order_relaxed);
+    }
+    inline DispatcherType getDispatcherType()
+    {
+        return m_dispatcherType;
+    }
+    // 边沿触发模式下, 读回调需要一直读到EAGAIN为止
+    inline bool isEdgeTriggered()
+    {
+        return m_dispatcherType == DispatcherType::EpollET;
+    }
+    // dispatcher直接完成读写(io_uring): 连接的读回调被调用时数据已经在读缓冲区中, 内存中的数据通过sendMsg()发送
+    inline bool isCompletionBased()
+    {
+        return m_completionBased;
+    }
+    // 完成模式下提交channel的sendmsg请求, 完成之后调用写回调, 发送的字节数通过channel->getResult()取得
+    // msg和它指向的内存在写回调被调用之前必须有效, 只能在反应堆的线程中调用
+    int sendMsg(Channel* channel, const struct msghdr* msg);
     static int readLocalMessage(void* arg);
+    // 根据fd取出对应的channel, 没有注册时返回nullptr
+    inline Channel* findChannel(int fd)
+    {
+        return fd >= 0 && fd < (int)m_channels.size() ? m_channels[fd].channel : nullptr;
+    }
+    inline uint32_t getGeneration(int fd)
+    {
+        return fd >= 0 && fd < (int)m_channels.size() ? m_channels[fd].generation : 0;
+    }
 
 private:
     void taskWakeup();
+    // 处理shutdown()的请求, 返回true表示反应堆可以退出了
+    bool checkShutdown();
+    // dispatch的超时时长, 停止期间不超过强制断开的期限
+    int getDispatchTimeout();
+    // 触发activateLater()添加的事件
+    void processPendingEvents();
+    // 用这一轮循环的处理时间更新m_busyTime
+    void updateBusyTime(uint64_t startUs);
 
 private:
     bool m_isQuit; // 用于标记当前的EventLoop是不是正在running，如果是则m_isQuit==false，否则为true
     // Dispatcher*是个父类指针，它通过指向不同子类的实例 EpollDispather, PollDispatcher, SelectDispathcher，从而实现多态
     Dispatcher* m_dispatcher;
-    // 任务队列
-    queue<ChannelElement*> m_taskQ; // <--任务队列，使用queue实现
-    // map
-    map<int, Channel*> m_channelMap; // 用于存储文件描述符，和文件描述符封装后对应的Channel类对象
+    DispatcherType m_dispatcherType;
+    bool m_completionBased;
+    // 任务队列, 节点直接按值存放在vector中, 不需要为每个任务new一个节点
+    vector<ChannelElement> m_taskQ; // <--任务队列，其他线程在加锁后向其中添加任务
+    // processTaskQ()在加锁后把m_taskQ整个交换到这里, 解锁后再逐个处理
+    // 两个vector交换后都保留着之前的容量, 稳定运行时不再分配内存
+    vector<ChannelElement> m_readyQ;
+    // 其他线程添加的定时器, 和m_taskQ一样交换之后处理
+    vector<TimerElement> m_timerQ;
+    vector<TimerElement> m_readyTimerQ;
+    // activateLater()添加的事件, 和任务队列一样交换之后处理
+    vector<PendingEvent> m_pendingEvents;
+    vector<PendingEvent> m_readyEvents;
+    // 定时器, 反应堆阻塞的时长由最近的定时器决定
+    TimerWheel m_timerWheel;
+    bool m_isProcessing = false; // 是否正在处理m_readyQ, 防止在处理任务时重入
+    // 以fd为下标的数组, 存储文件描述符封装后对应的Channel类对象, fd超出范围时自动扩容
+    vector<ChannelRecord> m_channels;
     // 线程id, name, mutex
     thread::id m_threadID; // 线程id，类型是thread::id
     string m_threadName;
     mutex m_mutex; // 互斥锁
-    int m_socketPair[2]; // 存储本地通信的fd 通过socketpair 初始化
+    int m_wakeupFd; // 用于唤醒反应堆的eventfd, 其他线程添加任务后向它写入数据
+    // 已经发送过唤醒信号并且反应堆还没有处理任务队列时为true, 这期间添加的任务不再重复唤醒
+    atomic<bool> m_wakeupPending;
+    // 创建之后不再改变, 取用时不需要加锁
+    atomic<MemoryPool*> m_connectionPool{ nullptr };
+    // shutdown()设置的强制断开连接的时刻(单调时钟, ms), UINT64_MAX表示没有停止
+    atomic<uint64_t> m_shutdownDeadline;
+    DrainState m_drainState = DrainState::None;
+    // 负载信息
+    atomic<int> m_connectionCount;
+    atomic<long> m_pendingBytes;
+    atomic<int> m_busyTime;
+    uint64_t m_eventStart = 0; // 这一轮循环处理第一个事件的时刻(us), 0表示还没有事件
+    int m_numaNode = -1;
 };
@@ -0,0 +1,343 @@
+#include "FileCache.h"
+#include "EventLoop.h"
+#include "HttpRequest.h"
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <mutex>
+
+// 文件和目录本身, 以及目录中的文件发生变化时都需要通知
+static const uint32_t WatchMask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+FileMeta::~FileMeta()
+{
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+FileCache* FileCache::getInstance()
+{
+    static FileCache cache;
+    return &cache;
+}
+
+FileCache::FileCache()
+{
+    // 缓存的普通文件一直占用文件描述符, 最多使用上限的一半, 上限很大时也不超过16384个路径
+    size_t count = 512;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    {
+        count = limit.rlim_cur / 2;
+    }
+    setMaxEntries(min<size_t>(count, 16384));
+}
+
+void FileCache::setMaxEntries(size_t count)
+{
+    // 每个分片单独计算, 淘汰时只需要锁住一个分片
+    m_maxEntriesPerShard = max<size_t>(count / ShardCount, 1);
+}
+
+bool FileCache::makeKey(string_view path, string& key)
+{
+    // 去掉末尾的 /, 目录 dir 和 dir/ 对应同一个key, 文档根目录的key为 .
+    while (!path.empty() && path.back() == '/')
+    {
+        path.remove_suffix(1);
+    }
+    if (path.empty() || path == ".")
+    {
+        key = ".";
+        return true;
+    }
+    if (path.front() == '/')
+    {
+        return false;
+    }
+    // 逐段检查, 保证同一个文件只有一种写法, inotify的事件才能对应到缓存
+    size_t start = 0;
+    while (start <= path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == string_view::npos)
+        {
+            end = path.size();
+        }
+        string_view segment = path.substr(start, end - start);
+        if (segment.empty() || segment == "." || segment == "..")
+        {
+            return false;
+        }
+        start = end + 1;
+    }
+    key.assign(path.data(), path.size());
+    return true;
+}
+
+shared_ptr<const FileMeta> FileCache::loadMeta(const char* path)
+{
+    auto meta = make_shared<FileMeta>();
+    if (stat(path, &meta->st) == -1)
+    {
+        return meta;
+    }
+    if (S_ISDIR(meta->st.st_mode))
+    {
+        meta->exists = true;
+        meta->mimeType = HttpRequest::getFileType(".html");
+        return meta;
+    }
+    // 普通文件打开之后一直保存在缓存中, 发送时使用sendfile指定偏移量, 多个连接可以共用
+    meta->fd = open(path, O_RDONLY | O_CLOEXEC);
+    // 打不开的文件和不存在一样处理
+    meta->exists = meta->fd != -1;
+    meta->mimeType = HttpRequest::getFileType(path);
+    if (meta->exists)
+    {
+        makeValidators(meta.get());
+    }
+    return meta;
+}
+
+void FileCache::makeValidators(FileMeta* meta)
+{
+    // 文件被替换(inode变化)或者修改(大小、纳秒级的修改时间变化)之后ETag都会不同
+    char buf[80];
+    int len = snprintf(buf, sizeof(buf), "\"%llx-%llx-%llx\"",
+        (unsigned long long)meta->st.st_ino, (unsigned long long)meta->st.st_size,
+        (unsigned long long)meta->st.st_mtim.tv_sec * 1000000000ULL + meta->st.st_mtim.tv_nsec);
+    meta->etag.assign(buf, len);
+    // Last-Modified: Sun, 06 Nov 1994 08:49:37 GMT
+    struct tm tm;
+    gmtime_r(&meta->st.st_mtime, &tm);
+    len = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    meta->lastModified.assign(buf, len);
+}
+
+shared_ptr<const FileMeta> FileCache::lookup(const char* path)
+{
+    // 每个线程重复使用同一个key, 不需要每次申请内存
+    static thread_local string key;
+    // 没有监视目录时无法知道文件什么时候变化, 不能使用缓存
+    if (m_inotifyFd == -1 || !makeKey(path, key))
+    {
+        return loadMeta(path);
+    }
+    Shard& shard = getShard(key);
+    uint64_t generation;
+    {
+        shared_lock<shared_mutex> locker(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end())
+        {
+            it->second.referenced.store(true, memory_order_relaxed);
+            return it->second.meta;
+        }
+        generation = shard.generation;
+    }
+    // stat和open在锁外执行, 不影响其他线程读取
+    shared_ptr<const FileMeta> meta = loadMeta(path);
+    unique_lock<shared_mutex> locker(shard.mutex);
+    if (shard.generation != generation)
+    {
+        // 期间文件可能发生了变化, 这次的结果可以使用, 但是不能放进缓存
+        return meta;
+    }
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end())
+    {
+        // 其他线程刚刚插入了
+        return it->second.meta;
+    }
+    // 缓存满了之后按CLOCK算法淘汰一个路径, 避免大量不同的路径(包括不存在的路径)占用内存和文件描述符
+    evict(shard);
+    auto result = shard.entries.try_emplace(key);
+    Entry& entry = result.first->second;
+    entry.meta = meta;
+    entry.ringIndex = shard.ring.size();
+    shard.ring.push_back(&*result.first);
+    return meta;
+}
+
+void FileCache::removeEntry(Shard& shard, size_t index)
+{
+    EntryMap::value_type* node = shard.ring[index];
+    // 用最后一个元素填补空位
+    shard.ring[index] = shard.ring.back();
+    shard.ring[index]->second.ringIndex = index;
+    shard.ring.pop_back();
+    // 正在发送的响应还持有meta, 发送完之后才会关闭文件
+    shard.entries.erase(shard.entries.find(node->first));
+}
+
+void FileCache::evict(Shard& shard)
+{
+    while (!shard.ring.empty() && shard.ring.size() >= m_maxEntriesPerShard)
+    {
+        if (shard.hand >= shard.ring.size())
+        {
+            shard.hand = 0;
+        }
+        // 最近被访问过的路径再给一次机会, 清除标记后跳过
+        if (shard.ring[shard.hand]->second.referenced.exchange(false))
+        {
+            ++shard.hand;
+            continue;
+        }
+        removeEntry(shard, shard.hand);
+    }
+}
+
+void FileCache::invalidate(const string& key)
+{
+    Shard& shard = getShard(key);
+    unique_lock<shared_mutex> locker(shard.mutex);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end())
+    {
+        removeEntry(shard, it->second.ringIndex);
+    }
+    ++shard.generation;
+}
+
+void FileCache::clear()
+{
+    for (Shard& shard : m_shards)
+    {
+        unique_lock<shared_mutex> locker(shard.mutex);
+        shard.entries.clear();
+        shard.ring.clear();
+        shard.hand = 0;
+        ++shard.generation;
+    }
+}
+
+bool FileCache::watch(EventLoop* evLoop, const string root)
+{
+    if (m_inotifyFd != -1)
+    {
+        return true;
+    }
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("inotify_init1");
+        return false;
+    }
+    m_inotifyFd = fd;
+    m_root = root;
+    addWatch(root, "");
+    // 由主反应堆检测inotify的读事件
+    auto readFunc = bind(&FileCache::processEvents, this);
+    Channel* channel = new Channel(fd, FDEvent::ReadEvent, readFunc, nullptr, nullptr, this);
+    evLoop->addTask(channel, ElemType::ADD);
+    return true;
+}
+
+void FileCache::addWatch(const string& dir, const string& prefix)
+{
+    int wd = inotify_add_watch(m_inotifyFd, dir.data(), WatchMask);
+    if (wd == -1)
+    {
+        perror("inotify_add_watch");
+        return;
+    }
+    m_watches[wd] = prefix;
+    // inotify只通知直接的子项, 子目录需要分别监视
+    DIR* dirp = opendir(dir.data());
+    if (dirp == nullptr)
+    {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dirp)) != nullptr)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        string subDir = dir + "/" + entry->d_name;
+        bool isDir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            isDir = lstat(subDir.data(), &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (isDir)
+        {
+            addWatch(subDir, prefix + entry->d_name + "/");
+        }
+    }
+    closedir(dirp);
+}
+
+int FileCache::processEvents()
+{
+    // inotify_event后面跟着长度不固定的文件名, 缓冲区需要按inotify_event对齐
+    alignas(struct inotify_event) char buf[4096];
+    while (true)
+    {
+        ssize_t len = read(m_inotifyFd, buf, sizeof(buf));
+        if (len <= 0)
+        {
+            // EAGAIN: 已经读完了, 边沿触发模式下需要一直读到这里
+            break;
+        }
+        for (char* ptr = buf; ptr < buf + len; )
+        {
+            struct inotify_event* event = reinterpret_cast<struct inotify_event*>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // 丢失了事件, 无法确定哪些缓存失效了
+                clear();
+                continue;
+            }
+            auto it = m_watches.find(event->wd);
+            if (it == m_watches.end())
+            {
+                continue;
+            }
+            if (event->mask & IN_IGNORED)
+            {
+                // 目录被删除之后watch自动失效
+                m_watches.erase(it);
+                continue;
+            }
+            string prefix = it->second;
+            string path = prefix + (event->len > 0 ? event->name : "");
+            if ((event->mask & IN_ISDIR) || (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)))
+            {
+                // 新建或者移入的目录也需要监视
+                if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+                {
+                    addWatch(m_root + "/" + path, path + "/");
+                }
+                // 目录的变化会影响它下面所有的路径, 直接清空
+                clear();
+                continue;
+            }
+            // 文件本身和它所在的目录(修改时间、目录列表)都需要重新读取
+            string key;
+            if (makeKey(path, key))
+            {
+                invalidate(key);
+            }
+            if (makeKey(prefix, key))
+            {
+                invalidate(key);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <shared_mutex>
+#include <sys/stat.h>
+#include <stdint.h>
+using namespace std;
+
+class EventLoop;
+
+// 一个路径对应的缓存信息, 创建之后不再修改, 多个线程可以同时读取
+struct FileMeta
+{
+    FileMeta() = default;
+    FileMeta(const FileMeta&) = delete;
+    FileMeta& operator=(const FileMeta&) = delete;
+    ~FileMeta();
+    bool exists = false;    // stat是否成功
+    struct stat st;
+    int fd = -1;            // 普通文件打开之后的文件描述符, 发送时直接使用
+    string_view mimeType;   // 指向MimeTypes中静态的存储
+    // 普通文件的验证器: 由inode、大小和修改时间生成的强ETag(带引号), HTTP日期格式的修改时间
+    string etag;
+    string lastModified;
+};
+
+// 静态资源的元数据缓存: 以解码之后的相对路径为key, 保存stat的结果、MIME类型和打开的文件描述符
+// 分成多个分片, 每个分片一把读写锁, 命中时只需要加读锁, 不需要任何系统调用
+// 通过inotify监视文档根目录(包括子目录), 文件被修改、删除或者新建时删除对应的缓存
+class FileCache
+{
+public:
+    // 分片的个数
+    static const int ShardCount = 16;
+
+    // 整个进程共用一个缓存
+    static FileCache* getInstance();
+    // 查找路径对应的信息, 没有缓存时stat并打开文件, 文件不存在时exists为false
+    // 返回的对象在使用期间一直有效, 即使缓存已经被删除
+    shared_ptr<const FileMeta> lookup(const char* path);
+    // 在evLoop(主反应堆)中监视root目录, 之后的修改会使缓存失效, 需要在工作线程启动之前调用
+    bool watch(EventLoop* evLoop, const string root);
+    // 是否已经开始监视目录, 没有监视时不使用缓存
+    inline bool isWatching()
+    {
+        return m_inotifyFd != -1;
+    }
+    // 最多缓存的路径个数(限制打开的文件描述符个数), 需要在工作线程启动之前设置
+    // 默认为文件描述符上限的一半, 剩下的留给连接使用
+    void setMaxEntries(size_t count);
+    inline size_t getMaxEntries()
+    {
+        return m_maxEntriesPerShard * ShardCount;
+    }
+    // 删除某个路径的缓存
+    void invalidate(const string& key);
+    // 删除所有的缓存
+    void clear();
+
+private:
+    FileCache();
+    struct Entry
+    {
+        shared_ptr<const FileMeta> meta;
+        // CLOCK算法的访问标记, 命中时只修改这个标记, 不需要写锁
+        atomic<bool> referenced{ true };
+        size_t ringIndex = 0;   // 在所属分片的环中的下标
+    };
+    using EntryMap = unordered_map<string, Entry>;
+    struct Shard
+    {
+        shared_mutex mutex;
+        EntryMap entries;
+        // CLOCK的环, 哈希表的节点在删除之前地址不变, 直接保存节点的指针
+        vector<EntryMap::value_type*> ring;
+        size_t hand = 0;        // CLOCK的指针
+        // 每次删除缓存时加1, 查找和插入之间被删除过时不再插入可能已经过期的结果
+        uint64_t generation = 0;
+    };
+    // 把路径转换成缓存的key, 包含 . .. 或者连续的 / 的路径不缓存
+    static bool makeKey(string_view path, string& key);
+    static shared_ptr<const FileMeta> loadMeta(const char* path);
+    // 从环和哈希表中删除一个缓存项, 需要持有分片的写锁
+    void removeEntry(Shard& shard, size_t index);
+    // 淘汰缓存项直到能再放下一个路径, 需要持有分片的写锁
+    void evict(Shard& shard);
+    // 根据stat的结果生成etag和lastModified
+    static void makeValidators(FileMeta* meta);
+    inline Shard& getShard(const string& key)
+    {
+        return m_shards[hash<string>()(key) % ShardCount];
+    }
+    // 监视dir目录及其所有子目录, prefix是dir在缓存key中的前缀
+    void addWatch(const string& dir, const string& prefix);
+    // inotify的读回调, 在主反应堆的线程中执行
+    int processEvents();
+
+private:
+    Shard m_shards[ShardCount];
+    size_t m_maxEntriesPerShard;
+    // 在工作线程启动之前设置, 之后只会被读取
+    int m_inotifyFd = -1;
+    string m_root;
+    // inotify的watch描述符 -> 目录在缓存key中的前缀, 只在主反应堆的线程中访问
+    unordered_map<int, string> m_watches;
+};
@@ -11,20 +11,128 @@
 #include "TcpConnection.h"
 #include <assert.h>
 #include <ctype.h>
+#include "DelimiterScanner.h"
+#include "FileCache.h"
+#include "ContentCache.h"
+#include "CompressionCache.h"
+#include "DirListingCache.h"
+#include "MimeTypes.h"
+#include <charconv>
+#include <random>
+#include <time.h>
 
-char* HttpRequest::splitRequestLine(const char* start, const char* end, const char* sub, function<void(string)> callback)
+// 和HttpHeader的顺序一一对应
+static const string_view KnownHeaderNames[] = {
+    "Host",
+    "Connection",
+    "Content-Length",
+    "Transfer-Encoding",
+    "Accept-Encoding",
+    "Range",
+    "If-Range",
+    "If-None-Match",
+    "If-Modified-Since",
+};
+static_assert(sizeof(KnownHeaderNames) / sizeof(KnownHeaderNames[0]) == static_cast<int>(HttpHeader::Count),
+    "KnownHeaderNames must match HttpHeader");
+
+// 不区分大小写比较两个字符串
+static inline bool equalsIgnoreCase(string_view a, string_view b)
 {
-    char* space = const_cast<char*>(end);
-    if (sub != nullptr)
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+// 去掉两端的空格和制表符
+static inline string_view trimSpace(string_view value)
+{
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+    {
+        value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
     {
-        space = static_cast<char*>(memmem(start, end - start, sub, strlen(sub)));
-        assert(space != nullptr);
+        value.remove_suffix(1);
     }
-    int length = space - start;
-    callback(string(start, length));
-    return space + 1;
+    return value;
 }
 
+// 解析一个非负的十进制数, 必须全部是数字
+static bool parseOffset(string_view value, off_t& result)
+{
+    if (value.empty() || value.front() < '0' || value.front() > '9')
+    {
+        return false;
+    }
+    long long number = 0;
+    auto [ptr, ec] = from_chars(value.data(), value.data() + value.size(), number);
+    if (ec != errc() || ptr != value.data() + value.size())
+    {
+        return false;
+    }
+    result = number;
+    return true;
+}
+
+// 解析HTTP日期 "Sun, 06 Nov 1994 08:49:37 GMT"
+static bool parseHttpDate(string_view value, time_t& result)
+{
+    char buf[64];
+    if (value.size() >= sizeof(buf))
+    {
+        return false;
+    }
+    memcpy(buf, value.data(), value.size());
+    buf[value.size()] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == nullptr || *end != '\0')
+    {
+        return false;
+    }
+    result = timegm(&tm);
+    return true;
+}
+
+// multipart/byteranges中的分隔符, 每个进程随机生成一次
+static string_view byteRangesBoundary()
+{
+    static const string boundary = [] {
+        random_device rd;
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%08x%08x", rd(), rd());
+        return string(buf, len);
+    }();
+    return boundary;
+}
+
+// 生成Content-Range的值 "bytes first-last/size", 返回长度
+static int formatContentRange(char* buf, off_t first, off_t last, off_t size)
+{
+    char* end = buf + 64;
+    char* ptr = buf;
+    memcpy(ptr, "bytes ", 6);
+    ptr += 6;
+    ptr = to_chars(ptr, end, static_cast<long long>(first)).ptr;
+    *ptr++ = '-';
+    ptr = to_chars(ptr, end, static_cast<long long>(last)).ptr;
+    *ptr++ = '/';
+    ptr = to_chars(ptr, end, static_cast<long long>(size)).ptr;
+    return ptr - buf;
+}
+
+int HttpRequest::findKnownHeader(string_view key)
+{
+    for (int i = 0; i < static_cast<int>(HttpHeader::Count); ++i)
+    {
+        // 先比较长度, 大部分情况下不需要逐个字符比较
+        if (equalsIgnoreCase(KnownHeaderNames[i], key))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
 
 // 将字符转换为整形数
 int HttpRequest::hexToDec(char c)
@@ -51,146 +159,291 @@ HttpRequest::~HttpRequest()
 void HttpRequest::reset()
 {
     m_curState = PrecessState::ParseReqLine;
-    m_method = m_url = m_version = string(); // ""
-    m_reqHeaders.clear();
+    m_method = m_url = m_version = string_view();
+    for (auto& header : m_knownHeaders)
+    {
+        header = string_view();
+    }
+    m_extraCount = 0;
+    m_delims.clear();
+    m_delimChecked = 0;
+    m_scanned = 0;
+    m_keepAlive = false;
+    m_bodyRemaining = 0;
 }
 
-void HttpRequest::addHeader(const string key, const string value)
+void HttpRequest::addHeader(string_view key, string_view value)
 {
     if (key.empty() || value.empty())
     {
         return;
     }
-    m_reqHeaders.insert(make_pair(key, value));
+    int index = findKnownHeader(key);
+    if (index >= 0)
+    {
+        m_knownHeaders[index] = value;
+        return;
+    }
+    if (m_extraCount < MaxExtraHeaders)
+    {
+        m_extraHeaders[m_extraCount][0] = key;
+        m_extraHeaders[m_extraCount][1] = value;
+        ++m_extraCount;
+    }
 }
 
-string HttpRequest::getHeader(const string key)
+string_view HttpRequest::getHeader(string_view key)
 {
-    auto item = m_reqHeaders.find(key);
-    if (item == m_reqHeaders.end())
+    int index = findKnownHeader(key);
+    if (index >= 0)
     {
-        return string();
+        return m_knownHeaders[index];
+    }
+    // 请求头的名字不区分大小写
+    for (int i = 0; i < m_extraCount; ++i)
+    {
+        if (equalsIgnoreCase(m_extraHeaders[i][0], key))
+        {
+            return m_extraHeaders[i][1];
+        }
     }
-    return item->second;
+    return string_view();
 }
 
-bool HttpRequest::parseRequestLine(Buffer* readBuf)
+bool HttpRequest::parseRequestLine(const char* start, const char* end)
 {
-    // 读出请求行, 保存字符串结束地址
-    char* end = readBuf->findCRLF();
-    // 保存字符串起始地址
-    char* start = readBuf->data();
-    // 请求行总长度
-    int lineSize = end - start;
+    // 请求行: 请求方式 空格 url 空格 协议版本
+    const char* space = static_cast<const char*>(memchr(start, ' ', end - start));
+    if (space == nullptr || space == start)
+    {
+        return false;
+    }
+    m_method = string_view(start, space - start);
+    start = space + 1;
+    space = static_cast<const char*>(memchr(start, ' ', end - start));
+    if (space == nullptr || space == start)
+    {
+        return false;
+    }
+    m_url = string_view(start, space - start);
+    start = space + 1;
+    if (start == end)
+    {
+        return false;
+    }
+    m_version = string_view(start, end - start);
+    return true;
+}
 
-    if (lineSize > 0)
+bool HttpRequest::parseRequestHeader(const char* start, const char* colon, const char* end)
+{
+    // 冒号后面和行尾的空格是可选的
+    const char* value = colon + 1;
+    while (value < end && (*value == ' ' || *value == '\t'))
     {
-        auto methodFunc = bind(&HttpRequest::setMethod, this, placeholders::_1);
-        start = splitRequestLine(start, end, " ", methodFunc);
-        auto urlFunc = bind(&HttpRequest::seturl, this, placeholders::_1);
-        start = splitRequestLine(start, end, " ", urlFunc);
-        auto versionFunc = bind(&HttpRequest::setVersion, this, placeholders::_1);
-        splitRequestLine(start, end, nullptr, versionFunc);
-        // 为解析请求头做准备
-        readBuf->readPosIncrease(lineSize + 2);
-        // 修改状态
-        setState(PrecessState::ParseReqHeaders);
-        return true;
+        ++value;
     }
-    return false;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+    {
+        --end;
+    }
+    addHeader(string_view(start, colon - start), string_view(value, end - value));
+    return true;
 }
 
-bool HttpRequest::parseRequestHeader(Buffer* readBuf)
+bool HttpRequest::parseRequestHead(Buffer* readBuf)
 {
-    char* end = readBuf->findCRLF();
-    if (end != nullptr)
+    // 忽略请求之间多余的空行
+    while (readBuf->readableSize() >= 2 && readBuf->data()[0] == '\r' && readBuf->data()[1] == '\n')
+    {
+        readBuf->readPosIncrease(2);
+        m_delims.clear();
+        m_delimChecked = 0;
+        m_scanned = 0;
+    }
+    const char* start = readBuf->data();
+    int readable = readBuf->readableSize();
+    // 只查找新接收到的数据, 超过长度上限的部分不用再看了
+    int limit = readable < MaxHeaderSize ? readable : MaxHeaderSize;
+    if (limit > m_scanned)
     {
-        char* start = readBuf->data();
-        int lineSize = end - start;
-        // 基于: 搜索字符串
-        char* middle = static_cast<char*>(memmem(start, lineSize, ": ", 2));
-        if (middle != nullptr)
+        DelimiterScanner::scan(start + m_scanned, limit - m_scanned, m_scanned, m_delims);
+        m_scanned = limit;
+    }
+    // 在新找到的换行符中查找请求头的结束标记 \r\n\r\n
+    int headSize = 0;
+    for (; m_delimChecked < m_delims.size(); ++m_delimChecked)
+    {
+        uint32_t pos = m_delims[m_delimChecked];
+        if (start[pos] != '\n')
+        {
+            continue;
+        }
+        // 每一行都必须以\r\n结尾, 只有\n的请求头永远等不到结束标记, 立即回复400
+        if (pos == 0 || start[pos - 1] != '\r')
+        {
+            return false;
+        }
+        if (pos >= 3 && memcmp(start + pos - 3, "\r\n\r\n", 4) == 0)
+        {
+            headSize = pos + 1;
+            break;
+        }
+    }
+    if (headSize == 0)
+    {
+        // 请求头还没有接收完
+        return readable <= MaxHeaderSize;
+    }
+
+    // 按照分隔符的位置切分出请求行和每一行请求头, 不再重复查找数据
+    uint32_t lineStart = 0;
+    const char* colon = nullptr;
+    for (size_t i = 0; i < m_delimChecked; ++i)
+    {
+        uint32_t pos = m_delims[i];
+        if (start[pos] == ':')
         {
-            int keyLen = middle - start;
-            int valueLen = end - middle - 2;
-            if (keyLen > 0 && valueLen > 0)
+            // 只有每一行的第一个冒号是请求头名字和值的分隔符
+            if (colon == nullptr)
             {
-                string key(start, keyLen);
-                string value(middle + 2, valueLen);
-                addHeader(key, value);
+                colon = start + pos;
             }
-            // 移动读数据的位置
-            readBuf->readPosIncrease(lineSize + 2);
+            continue;
         }
-        else
+        if (start[pos] == '\r')
         {
-            // 请求头被解析完了, 跳过空行
-            readBuf->readPosIncrease(2);
-            // 修改解析状态
-            // 忽略 post 请求, 按照 get 请求处理
-            setState(PrecessState::ParseReqDone);
+            continue;
         }
-        return true;
+        // 查找结束标记时已经确认过每个\n前面都是\r
+        const char* lineEnd = start + pos - 1;
+        if (m_curState == PrecessState::ParseReqLine)
+        {
+            if (!parseRequestLine(start + lineStart, lineEnd))
+            {
+                return false;
+            }
+            setState(PrecessState::ParseReqHeaders);
+        }
+        else if (colon == nullptr || !parseRequestHeader(start + lineStart, colon, lineEnd))
+        {
+            return false;
+        }
+        lineStart = pos + 1;
+        colon = nullptr;
+    }
+    // string_view指向的内存在下次接收数据之前不会被覆盖, 可以先移动读位置
+    readBuf->readPosIncrease(headSize);
+
+    // 不支持分块传输的请求体, 无法确定请求的边界
+    if (!getHeader(HttpHeader::TransferEncoding).empty())
+    {
+        return false;
     }
-    return false;
+    // 有请求体时需要把它跳过, 否则同一个连接上的下一个请求会从请求体的中间开始解析
+    m_bodyRemaining = 0;
+    for (char c : getHeader(HttpHeader::ContentLength))
+    {
+        if (c < '0' || c > '9' || m_bodyRemaining > (1L << 48))
+        {
+            return false;
+        }
+        m_bodyRemaining = m_bodyRemaining * 10 + (c - '0');
+    }
+    // HTTP/1.1 默认保持连接, HTTP/1.0 需要客户端明确要求
+    string_view connection = getHeader(HttpHeader::Connection);
+    if (equalsIgnoreCase(m_version, "HTTP/1.1"))
+    {
+        m_keepAlive = !equalsIgnoreCase(connection, "close");
+    }
+    else
+    {
+        m_keepAlive = equalsIgnoreCase(connection, "keep-alive");
+    }
+    // 修改解析状态
+    setState(m_bodyRemaining > 0 ? PrecessState::ParseReqBody : PrecessState::ParseReqDone);
+    return true;
 }
 
-bool HttpRequest::parseHttpRequest(Buffer* readBuf, HttpResponse* response, Buffer* sendBuf, int socket)
+bool HttpRequest::parseRequestBody(Buffer* readBuf)
 {
-    bool flag = true;
-    while (m_curState != PrecessState::ParseReqDone)
+    // 只处理 get 请求, 请求体直接丢弃
+    long size = readBuf->readableSize();
+    if (size > m_bodyRemaining)
+    {
+        size = m_bodyRemaining;
+    }
+    readBuf->readPosIncrease(size);
+    m_bodyRemaining -= size;
+    if (m_bodyRemaining == 0)
     {
-        switch (m_curState)
+        setState(PrecessState::ParseReqDone);
+    }
+    return true;
+}
+
+bool HttpRequest::parseHttpRequest(Buffer* readBuf, HttpResponse* response, Buffer* sendBuf)
+{
+    if (m_curState == PrecessState::ParseReqLine)
+    {
+        if (!parseRequestHead(readBuf))
         {
-        case PrecessState::ParseReqLine:
-            flag = parseRequestLine(readBuf);
-            break;
-        case PrecessState::ParseReqHeaders:
-            flag = parseRequestHeader(readBuf);
-            break;
-        case PrecessState::ParseReqBody:
-            break;
-        default:
-            break;
+            return false;
         }
-        if (!flag)
+        if (m_curState == PrecessState::ParseReqLine)
         {
-            return flag;
+            // 数据不完整, 等接收到更多的数据之后继续解析
+            return true;
         }
-        // 判断是否解析完毕了, 如果完毕了, 需要准备回复的数据
-        if (m_curState == PrecessState::ParseReqDone)
+        // 请求头解析完了, 在接收请求体之前处理请求, 之后string_view就可能失效了
+        // 1. 根据解析出的原始数据, 对客户端的请求做出处理
+        if (!processHttpRequest(response))
         {
-            // 1. 根据解析出的原始数据, 对客户端的请求做出处理
-            processHttpRequest(response);
-            // 2. 组织响应数据并发送给客户端
-            response->prepareMsg(sendBuf, socket);
+            return false;
         }
+        // 2. 组织响应数据, 写入sendBuf之后由TcpConnection发送给客户端
+        response->prepareMsg(sendBuf);
+    }
+    if (m_curState == PrecessState::ParseReqBody)
+    {
+        parseRequestBody(readBuf);
     }
-    m_curState = PrecessState::ParseReqLine;   // 状态还原, 保证还能继续处理第二条及以后的请求
-    return flag;
+    // 状态由调用者通过reset()还原, 保证还能继续处理第二条及以后的请求
+    return true;
 }
 
 bool HttpRequest::processHttpRequest(HttpResponse* response)
 {
-    if (strcasecmp(m_method.data(), "get") != 0)
+    if (!equalsIgnoreCase(m_method, "get"))
     {
-        return -1;
+        // 只支持GET, 其他的方法回复405并通过Allow告诉客户端, 请求体会被跳过, 连接可以继续使用
+        response->setStatusCode(StatusCode::MethodNotAllowed);
+        response->addHeader("Allow", "GET");
+        response->addHeader("Content-length", 0LL);
+        response->addHeader("Connection", m_keepAlive ? "keep-alive" : "close");
+        return true;
+    }
+    // 查询字符串不是文件名的一部分
+    string_view url = m_url.substr(0, m_url.find('?'));
+    decodeMsg(url, m_path);
+    // 路径为空(如 "GET ?x HTTP/1.1")、不是以'/'开头或者会访问到文档根目录之外的请求, 回复400
+    if (!isSafePath(m_path))
+    {
+        return false;
     }
-    m_url = decodeMsg(m_url);
     // 处理客户端请求的静态资源(目录或者文件)
     const char* file = NULL;
-    if (strcmp(m_url.data(), "/") == 0)
+    if (m_path == "/")
     {
         file = "./";
     }
     else
     {
-        file = m_url.data() + 1;
+        file = m_path.data() + 1;
     }
-    // 获取文件属性
-    struct stat st;
-    int ret = stat(file, &st);
-    if (ret == -1)
+    // 获取文件属性, 命中缓存时不需要stat和open
+    shared_ptr<const FileMeta> meta = FileCache::getInstance()->lookup(file);
+    if (!meta->exists)
     {
         // 文件不存在 -- 回复404
         //sendHeadMsg(cfd, 404, "Not Found", getFileType(".html"), -1);
@@ -199,21 +452,42 @@ bool HttpRequest::processHttpRequest(HttpResponse* response)
         response->setStatusCode(StatusCode::NotFound);
         // 响应头
         response->addHeader("Content-type", getFileType(".html"));
-        response->sendDataFunc = sendFile;
-        return 0;
+        // 保持连接时客户端需要根据Content-length确定响应的边界
+        shared_ptr<const FileMeta> page = FileCache::getInstance()->lookup("404.html");
+        if (page->exists && !S_ISDIR(page->st.st_mode))
+        {
+            response->addHeader("Content-length", page->st.st_size);
+            addFileBody(response, page);
+        }
+        else
+        {
+            response->addHeader("Content-length", 0LL);
+        }
+        response->addHeader("Connection", m_keepAlive ? "keep-alive" : "close");
+        return true;
     }
 
     response->setFileName(file);
     response->setStatusCode(StatusCode::OK);
     // 判断文件类型
-    if (S_ISDIR(st.st_mode))
+    if (S_ISDIR(meta->st.st_mode))
     {
         // 把这个目录中的内容发送给客户端
         //sendHeadMsg(cfd, 200, "OK", getFileType(".html"), -1);
         //sendDir(file, cfd);
         // 响应头
-        response->addHeader("Content-type", getFileType(".html"));
-        response->sendDataFunc = sendDir;
+        response->addHeader("Content-type", meta->mimeType);
+        // 列表页面生成之后缓存起来, 和响应头一起一次发送, 有了Content-length之后可以保持连接
+        shared_ptr<const string> listing = DirListingCache::getInstance()->lookup(file, meta);
+        if (listing != nullptr)
+        {
+            response->addHeader("Content-length", static_cast<long long>(listing->size()));
+            response->addMemorySegment(listing->data(), listing->size(), listing);
+        }
+        else
+        {
+            response->addHeader("Content-length", 0LL);
+        }
     }
     else
     {
@@ -221,133 +495,497 @@ bool HttpRequest::processHttpRequest(HttpResponse* response)
         //sendHeadMsg(cfd, 200, "OK", getFileType(file), st.st_size);
         //sendFile(file, cfd);
         // 响应头
-        response->addHeader("Content-type", getFileType(file));
-        response->addHeader("Content-length", to_string(st.st_size));
+        if (isCompressible(meta))
+        {
+            // 响应的内容取决于Accept-Encoding, 缓存服务器需要按它区分
+            response->addHeader("Vary", "Accept-Encoding");
+        }
+        response->addHeader("Accept-Ranges", "bytes");
+        // 客户端缓存的内容还有效时只回复响应头, 不需要读取文件
+        if (isNotModified(meta))
+        {
+            response->setStatusCode(StatusCode::NotModified);
+            addValidators(response, meta,
+                isCompressible(meta) && negotiateEncoding() != ContentEncoding::Identity);
+            response->addHeader("Connection", m_keepAlive ? "keep-alive" : "close");
+            return true;
+        }
+        // 文件在客户端缓存之后发生了变化时忽略Range, 重新发送整个文件
+        RangeResult range = RangeResult::Ignore;
+        if (!getHeader(HttpHeader::Range).empty() && checkIfRange(meta))
+        {
+            range = parseRange(meta->st.st_size);
+        }
+        if (range == RangeResult::Satisfiable)
+        {
+            // 部分内容只按原始的编码发送
+            addValidators(response, meta, false);
+            addRangeBody(response, meta);
+        }
+        else if (range == RangeResult::Unsatisfiable)
+        {
+            response->setStatusCode(StatusCode::RangeNotSatisfiable);
+            string contentRange = "bytes */";
+            contentRange.append(to_string(meta->st.st_size));
+            response->addHeader("Content-Range", contentRange);
+            response->addHeader("Content-length", 0LL);
+        }
+        else
+        {
+            response->addHeader("Content-type", meta->mimeType);
+            if (isCompressible(meta) && addCompressedBody(response, file, meta, negotiateEncoding()))
+            {
+                // 压缩之后的内容和原文件不是逐字节相同的, 只能使用弱ETag
+                addValidators(response, meta, true);
+            }
+            else
+            {
+                addValidators(response, meta, false);
+                response->addHeader("Content-length", meta->st.st_size);
+                addFileBody(response, meta);
+            }
+        }
+    }
+    response->addHeader("Connection", m_keepAlive ? "keep-alive" : "close");
+
+    return true;
+}
+
+void HttpRequest::addFileBody(HttpResponse* response, const shared_ptr<const FileMeta>& meta, off_t offset, off_t size)
+{
+    if (size < 0)
+    {
+        size = meta->st.st_size - offset;
+    }
+    // 缓存了内容的文件和响应头一起通过一次sendmsg发送
+    shared_ptr<const ContentEntry> content = ContentCache::getInstance()->lookup(meta);
+    if (content != nullptr && offset + size <= static_cast<off_t>(content->size))
+    {
+        response->addMemorySegment(content->data + offset, size, content);
+        return;
+    }
+#ifndef SEND_FILE_ZERO_COPY
+    if (offset == 0 && size == meta->st.st_size)
+    {
         response->sendDataFunc = sendFile;
+        return;
     }
+#endif
+    // 缓存中的文件描述符由meta持有, 发送完之前不会被关闭
+    // 文件的一部分也直接从对应的偏移量开始发送, 不需要把整个文件读到内存中
+    response->addFileSegment(meta->fd, offset, size, meta);
+}
 
-    return false;
+bool HttpRequest::checkIfRange(const shared_ptr<const FileMeta>& meta)
+{
+    string_view value = getHeader(HttpHeader::IfRange);
+    if (value.empty())
+    {
+        return true;
+    }
+    // If-Range的值是实体标签或者日期, 和当前的文件一致时Range才有效
+    value = trimSpace(value);
+    if (!value.empty() && (value.front() == '"' || value.front() == 'W'))
+    {
+        // 实体标签使用强比较, 弱ETag一定不一致
+        return value == meta->etag;
+    }
+    time_t date = 0;
+    if (!parseHttpDate(value, date))
+    {
+        return false;
+    }
+    return date == meta->st.st_mtime;
+}
+
+bool HttpRequest::isNotModified(const shared_ptr<const FileMeta>& meta)
+{
+    // 有If-None-Match时忽略If-Modified-Since
+    string_view value = getHeader(HttpHeader::IfNoneMatch);
+    if (!value.empty())
+    {
+        // If-None-Match: "a", W/"b" 或者 *, 使用弱比较
+        while (!value.empty())
+        {
+            size_t comma = value.find(',');
+            string_view tag = trimSpace(value.substr(0, comma));
+            value = comma == string_view::npos ? string_view() : value.substr(comma + 1);
+            if (tag.size() > 2 && tag[0] == 'W' && tag[1] == '/')
+            {
+                tag.remove_prefix(2);
+            }
+            if (tag == "*" || tag == meta->etag)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    value = getHeader(HttpHeader::IfModifiedSince);
+    time_t date = 0;
+    if (value.empty() || !parseHttpDate(trimSpace(value), date))
+    {
+        return false;
+    }
+    // 日期只精确到秒
+    return meta->st.st_mtime <= date;
+}
+
+void HttpRequest::addValidators(HttpResponse* response, const shared_ptr<const FileMeta>& meta, bool weak)
+{
+    if (weak)
+    {
+        char buf[96];
+        memcpy(buf, "W/", 2);
+        size_t len = min(meta->etag.size(), sizeof(buf) - 2);
+        memcpy(buf + 2, meta->etag.data(), len);
+        response->addHeader("ETag", string_view(buf, len + 2));
+    }
+    else
+    {
+        response->addHeader("ETag", meta->etag);
+    }
+    response->addHeader("Last-Modified", meta->lastModified);
+}
+
+RangeResult HttpRequest::parseRange(off_t fileSize)
+{
+    // Range: bytes=0-499, 500-, -200
+    m_ranges.clear();
+    string_view value = trimSpace(getHeader(HttpHeader::Range));
+    if (value.size() < 6 || !equalsIgnoreCase(value.substr(0, 6), "bytes="))
+    {
+        return RangeResult::Ignore;
+    }
+    value.remove_prefix(6);
+    bool hasSpec = false;
+    off_t total = 0;
+    while (!value.empty())
+    {
+        size_t comma = value.find(',');
+        string_view spec = trimSpace(value.substr(0, comma));
+        value = comma == string_view::npos ? string_view() : value.substr(comma + 1);
+        if (spec.empty())
+        {
+            continue;
+        }
+        size_t dash = spec.find('-');
+        if (dash == string_view::npos)
+        {
+            return RangeResult::Ignore;
+        }
+        string_view firstPart = trimSpace(spec.substr(0, dash));
+        string_view lastPart = trimSpace(spec.substr(dash + 1));
+        off_t first = 0, last = 0;
+        if (firstPart.empty())
+        {
+            // -n 表示最后n个字节
+            off_t count = 0;
+            if (!parseOffset(lastPart, count))
+            {
+                return RangeResult::Ignore;
+            }
+            hasSpec = true;
+            if (count == 0 || fileSize == 0)
+            {
+                continue;
+            }
+            first = count >= fileSize ? 0 : fileSize - count;
+            last = fileSize - 1;
+        }
+        else
+        {
+            if (!parseOffset(firstPart, first))
+            {
+                return RangeResult::Ignore;
+            }
+            if (lastPart.empty())
+            {
+                last = fileSize - 1;
+            }
+            else if (!parseOffset(lastPart, last) || last < first)
+            {
+                return RangeResult::Ignore;
+            }
+            hasSpec = true;
+            // 起始位置超出文件的范围无法满足, 结束位置超出时截断到文件末尾
+            if (first >= fileSize)
+            {
+                continue;
+            }
+            last = min(last, fileSize - 1);
+        }
+        if (m_ranges.size() == MaxRanges)
+        {
+            return RangeResult::Ignore;
+        }
+        m_ranges.push_back(ByteRange{ first, last });
+        total += last - first + 1;
+    }
+    if (!hasSpec)
+    {
+        return RangeResult::Ignore;
+    }
+    if (m_ranges.empty())
+    {
+        return RangeResult::Unsatisfiable;
+    }
+    // 范围之间重叠太多, 不如直接发送整个文件
+    if (total > fileSize)
+    {
+        return RangeResult::Ignore;
+    }
+    return RangeResult::Satisfiable;
 }
 
-string HttpRequest::decodeMsg(string msg)
+void HttpRequest::addRangeBody(HttpResponse* response, const shared_ptr<const FileMeta>& meta)
 {
-    string str = string();
-    const char* from = msg.data();
-    for (; *from != '\0'; ++from)
+    response->setStatusCode(StatusCode::PartialContent);
+    char contentRange[64];
+    if (m_ranges.size() == 1)
+    {
+        // 只有一个范围时直接发送这一段
+        const ByteRange& range = m_ranges.front();
+        int len = formatContentRange(contentRange, range.first, range.last, meta->st.st_size);
+        response->addHeader("Content-type", meta->mimeType);
+        response->addHeader("Content-Range", string_view(contentRange, len));
+        response->addHeader("Content-length", range.last - range.first + 1);
+        addFileBody(response, meta, range.first, range.last - range.first + 1);
+        return;
+    }
+    // 多个范围使用multipart/byteranges, 每一段之前是分隔符和这一段的头
+    // 所有的分段头拼接在同一块内存中, 发送完之前由响应的片段持有
+    string_view boundary = byteRangesBoundary();
+    auto parts = make_shared<string>();
+    parts->reserve(m_ranges.size() * (boundary.size() + meta->mimeType.size() + 80));
+    size_t marks[MaxRanges + 1];
+    off_t bodySize = 0;
+    for (size_t i = 0; i < m_ranges.size(); ++i)
+    {
+        const ByteRange& range = m_ranges[i];
+        marks[i] = parts->size();
+        parts->append("\r\n--").append(boundary);
+        parts->append("\r\nContent-type: ").append(meta->mimeType);
+        int len = formatContentRange(contentRange, range.first, range.last, meta->st.st_size);
+        parts->append("\r\nContent-Range: ").append(contentRange, len).append("\r\n\r\n");
+        bodySize += range.last - range.first + 1;
+    }
+    marks[m_ranges.size()] = parts->size();
+    parts->append("\r\n--").append(boundary).append("--\r\n");
+    bodySize += parts->size();
+
+    string contentType = "multipart/byteranges; boundary=";
+    contentType.append(boundary);
+    response->addHeader("Content-type", contentType);
+    response->addHeader("Content-length", bodySize);
+    for (size_t i = 0; i < m_ranges.size(); ++i)
+    {
+        const ByteRange& range = m_ranges[i];
+        response->addMemorySegment(parts->data() + marks[i], marks[i + 1] - marks[i], parts);
+        addFileBody(response, meta, range.first, range.last - range.first + 1);
+    }
+    size_t tail = marks[m_ranges.size()];
+    response->addMemorySegment(parts->data() + tail, parts->size() - tail, parts);
+}
+
+bool HttpRequest::isCompressible(const shared_ptr<const FileMeta>& meta)
+{
+    // 太小的文件压缩之后节省不了多少, 图片、音视频等格式本身已经压缩过了
+    if (meta->st.st_size < MinCompressSize)
+    {
+        return false;
+    }
+    string_view type = meta->mimeType;
+    return type.compare(0, 5, "text/") == 0 || type.find("javascript") != string_view::npos ||
+        type.find("json") != string_view::npos || type.find("xml") != string_view::npos;
+}
+
+ContentEncoding HttpRequest::negotiateEncoding()
+{
+    // Accept-Encoding: gzip;q=1.0, deflate;q=0.5, *;q=0
+    string_view value = getHeader(HttpHeader::AcceptEncoding);
+    int gzipQ = -1, deflateQ = -1, anyQ = -1;   // q值放大1000倍, -1表示没有出现
+    while (!value.empty())
+    {
+        size_t comma = value.find(',');
+        string_view item = value.substr(0, comma);
+        value = comma == string_view::npos ? string_view() : value.substr(comma + 1);
+        // 拆出编码名称和参数
+        size_t semicolon = item.find(';');
+        string_view coding = item.substr(0, semicolon);
+        string_view params = semicolon == string_view::npos ? string_view() : item.substr(semicolon + 1);
+        coding = trimSpace(coding);
+        int q = 1000;
+        size_t pos = params.find("q=");
+        if (pos != string_view::npos)
+        {
+            // q的取值是0到1, 最多3位小数
+            q = 0;
+            int scale = 1000;
+            bool fraction = false;
+            for (char c : params.substr(pos + 2))
+            {
+                if (c == '.' && !fraction)
+                {
+                    fraction = true;
+                }
+                else if (c >= '0' && c <= '9')
+                {
+                    if (!fraction)
+                    {
+                        q = (c - '0') * 1000;
+                    }
+                    else if (scale > 1)
+                    {
+                        scale /= 10;
+                        q += (c - '0') * scale;
+                    }
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }
+        if (equalsIgnoreCase(coding, "gzip") || equalsIgnoreCase(coding, "x-gzip"))
+        {
+            gzipQ = q;
+        }
+        else if (equalsIgnoreCase(coding, "deflate"))
+        {
+            deflateQ = q;
+        }
+        else if (coding == "*")
+        {
+            anyQ = q;
+        }
+    }
+    // 没有单独列出的编码使用 * 的q值
+    if (gzipQ == -1)
+    {
+        gzipQ = anyQ;
+    }
+    if (deflateQ == -1)
+    {
+        deflateQ = anyQ;
+    }
+    // q值相同时优先使用gzip, q=0表示不接受
+    if (gzipQ > 0 && gzipQ >= deflateQ)
+    {
+        return ContentEncoding::Gzip;
+    }
+    if (deflateQ > 0)
+    {
+        return ContentEncoding::Deflate;
+    }
+    return ContentEncoding::Identity;
+}
+
+bool HttpRequest::addCompressedBody(HttpResponse* response, const char* file,
+    const shared_ptr<const FileMeta>& meta, ContentEncoding encoding)
+{
+    if (encoding == ContentEncoding::Gzip)
+    {
+        // 优先使用预先压缩好的 file.gz, 它比原文件旧时说明已经过期了
+        m_sidecar.assign(file);
+        m_sidecar.append(".gz");
+        shared_ptr<const FileMeta> sidecar = FileCache::getInstance()->lookup(m_sidecar.data());
+        if (sidecar->exists && S_ISREG(sidecar->st.st_mode) && sidecar->st.st_mtime >= meta->st.st_mtime)
+        {
+            response->addHeader("Content-Encoding", "gzip");
+            response->addHeader("Content-length", sidecar->st.st_size);
+            response->setFileName(m_sidecar);
+            addFileBody(response, sidecar);
+            return true;
+        }
+    }
+    if (encoding == ContentEncoding::Identity)
+    {
+        return false;
+    }
+    // 交给后台线程压缩一次, 结果保存在缓存中供之后的请求使用, 压缩完成之前发送原文件
+    shared_ptr<const CompressedEntry> compressed = CompressionCache::getInstance()->lookup(meta, encoding);
+    if (compressed == nullptr)
+    {
+        return false;
+    }
+    response->addHeader("Content-Encoding", encoding == ContentEncoding::Gzip ? "gzip" : "deflate");
+    response->addHeader("Content-length", static_cast<long long>(compressed->data.size()));
+    response->addMemorySegment(compressed->data.data(), compressed->data.size(), compressed);
+    return true;
+}
+
+bool HttpRequest::isSafePath(string_view path)
+{
+    if (path.empty() || path[0] != '/')
+    {
+        return false;
+    }
+    // 路径作为C字符串打开文件, 中间的'\0'(%00)会截断文件名
+    if (path.find('\0') != string_view::npos)
+    {
+        return false;
+    }
+    // 解码之后逐段检查, "/../etc/passwd" 和 "/%2e%2e/..." 都不允许
+    size_t start = 1;
+    while (start <= path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == string_view::npos)
+        {
+            end = path.size();
+        }
+        if (path.substr(start, end - start) == "..")
+        {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+void HttpRequest::decodeMsg(string_view from, string& to)
+{
+    // clear()不释放内存, 同一个连接上的后续请求不需要重新申请
+    to.clear();
+    for (size_t i = 0; i < from.size(); ++i)
     {
         // isxdigit -> 判断字符是不是16进制格式, 取值在 0-f
         // Linux%E5%86%85%E6%A0%B8.jpg
-        if (from[0] == '%' && isxdigit(from[1]) && isxdigit(from[2]))
+        if (from[i] == '%' && i + 2 < from.size() && isxdigit(from[i + 1]) && isxdigit(from[i + 2]))
         {
             // 将16进制的数 -> 十进制 将这个数值赋值给了字符 int -> char
             // B2 == 178
             // 将3个字符, 变成了一个字符, 这个字符就是原始数据
-            str.append(1, hexToDec(from[1]) * 16 + hexToDec(from[2]));
+            to.push_back(hexToDec(from[i + 1]) * 16 + hexToDec(from[i + 2]));
 
-            // 跳过 from[1] 和 from[2] 因此在当前循环中已经处理过了
-            from += 2;
+            // 跳过 from[i + 1] 和 from[i + 2] 因此在当前循环中已经处理过了
+            i += 2;
         }
         else
         {
             // 字符拷贝, 赋值
-            str.append(1, *from);
+            to.push_back(from[i]);
         }
     }
-    str.append(1, '\0');
-    return str;
 }
 
-const string HttpRequest::getFileType(const string name)
+string_view HttpRequest::getFileType(string_view name)
 {
     // a.jpg a.mp4 a.html
-    // 自右向左查找‘.’字符, 如不存在返回NULL
-    const char* dot = strrchr(name.data(), '.');
-    if (dot == NULL)
-        return "text/plain; charset=utf-8";	// 纯文本
-    if (strcmp(dot, ".html") == 0 || strcmp(dot, ".htm") == 0)
-        return "text/html; charset=utf-8";
-    if (strcmp(dot, ".jpg") == 0 || strcmp(dot, ".jpeg") == 0)
-        return "image/jpeg";
-    if (strcmp(dot, ".gif") == 0)
-        return "image/gif";
-    if (strcmp(dot, ".png") == 0)
-        return "image/png";
-    if (strcmp(dot, ".css") == 0)
-        return "text/css";
-    if (strcmp(dot, ".au") == 0)
-        return "audio/basic";
-    if (strcmp(dot, ".wav") == 0)
-        return "audio/wav";
-    if (strcmp(dot, ".avi") == 0)
-        return "video/x-msvideo";
-    if (strcmp(dot, ".mov") == 0 || strcmp(dot, ".qt") == 0)
-        return "video/quicktime";
-    if (strcmp(dot, ".mpeg") == 0 || strcmp(dot, ".mpe") == 0)
-        return "video/mpeg";
-    if (strcmp(dot, ".vrml") == 0 || strcmp(dot, ".wrl") == 0)
-        return "model/vrml";
-    if (strcmp(dot, ".midi") == 0 || strcmp(dot, ".mid") == 0)
-        return "audio/midi";
-    if (strcmp(dot, ".mp3") == 0)
-        return "audio/mpeg";
-    if (strcmp(dot, ".ogg") == 0)
-        return "application/ogg";
-    if (strcmp(dot, ".pac") == 0)
-        return "application/x-ns-proxy-autoconfig";
-
-    return "text/plain; charset=utf-8";
-}
-
-void HttpRequest::sendDir(string dirName, Buffer* sendBuf, int cfd)
-{
-    char buf[4096] = { 0 };
-    sprintf(buf, "<html><head><title>%s</title></head><body><table>", dirName.data());
-    struct dirent** namelist;
-    int num = scandir(dirName.data(), &namelist, NULL, alphasort);
-    for (int i = 0; i < num; ++i)
-    {
-        // 取出文件名 namelist 指向的是一个指针数组 struct dirent* tmp[]
-        char* name = namelist[i]->d_name;
-        struct stat st;
-        char subPath[1024] = { 0 };
-        sprintf(subPath, "%s/%s", dirName.data(), name);
-        stat(subPath, &st);
-        if (S_ISDIR(st.st_mode))
-        {
-            // a标签 <a href="">name</a>
-            sprintf(buf + strlen(buf),
-                "<tr><td><a href=\"%s/\">%s</a></td><td>%ld</td></tr>",
-                name, name, st.st_size);
-        }
-        else
-        {
-            sprintf(buf + strlen(buf),
-                "<tr><td><a href=\"%s\">%s</a></td><td>%ld</td></tr>",
-                name, name, st.st_size);
-        }
-        // send(cfd, buf, strlen(buf), 0);
-        sendBuf->appendString(buf);
-#ifndef MSG_SEND_AUTO
-        sendBuf->sendData(cfd);
-#endif
-        memset(buf, 0, sizeof(buf));
-        free(namelist[i]);
-    }
-    sprintf(buf, "</table></body></html>");
-    // send(cfd, buf, strlen(buf), 0);
-    sendBuf->appendString(buf);
-#ifndef MSG_SEND_AUTO
-    sendBuf->sendData(cfd);
-#endif
-    free(namelist);
+    return MimeTypes::lookup(name);
 }
 
-void HttpRequest::sendFile(string fileName, Buffer* sendBuf, int cfd)
+void HttpRequest::sendFile(string fileName, Buffer* sendBuf)
 {
     // 1. 打开文件
     int fd = open(fileName.data(), O_RDONLY);
-    assert(fd > 0);
-#if 1
+    if (fd == -1)
+    {
+        perror("open");
+        return;
+    }
+    // 零拷贝的发送方式见 HttpResponse::sendData()
     while (1)
     {
         char buf[1024];
@@ -356,9 +994,6 @@ void HttpRequest::sendFile(string fileName, Buffer* sendBuf, int cfd)
         {
             // send(cfd, buf, len, 0);
             sendBuf->appendString(buf, len);
-#ifndef MSG_SEND_AUTO
-            sendBuf->sendData(cfd);
-#endif
         }
         else if (len == 0)
         {
@@ -366,23 +1001,9 @@ void HttpRequest::sendFile(string fileName, Buffer* sendBuf, int cfd)
         }
         else
         {
-            close(fd);
             perror("read");
+            break;
         }
     }
-#else
-    off_t offset = 0;
-    int size = lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET);
-    while (offset < size)
-    {
-        int ret = sendfile(cfd, fd, &offset, size - offset);
-        printf("ret value: %d\n", ret);
-        if (ret == -1 && errno == EAGAIN)
-        {
-            printf("没数据...\n");
-        }
-    }
-#endif
     close(fd);
 }
@@ -2,7 +2,14 @@
 #include "Buffer.h"
 #include <stdbool.h>
 #include "HttpResponse.h"
-#include <map>
+#include "FileCache.h"
+#include "CompressionCache.h"
+#include "DelimiterScanner.h"
+#include "SmallVector.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
 using namespace std;
 
 // 当前的解析状态
@@ -13,42 +20,113 @@ enum class PrecessState:char
     ParseReqBody,
     ParseReqDone
 };
+// 服务器需要用到的请求头, 解析时直接保存到固定的位置, 不需要按名字查找
+enum class HttpHeader:char
+{
+    Host,
+    Connection,
+    ContentLength,
+    TransferEncoding,
+    AcceptEncoding,
+    Range,
+    IfRange,
+    IfNoneMatch,
+    IfModifiedSince,
+    Count
+};
+// Range请求头中的一个字节范围, 包含first和last
+struct ByteRange
+{
+    off_t first;
+    off_t last;
+};
+// Range请求头的处理结果
+enum class RangeResult:char
+{
+    Ignore,         // 没有Range或者不能按Range处理, 发送整个文件
+    Satisfiable,    // 回复206, 范围保存在m_ranges中
+    Unsatisfiable   // 所有的范围都超出了文件, 回复416
+};
 // 定义http请求结构体
+// 请求行和请求头都是指向读缓冲区的string_view, 不拷贝数据, 只在处理当前请求的过程中有效
 class HttpRequest
 {
 public:
+    // 请求行和请求头的总长度上限, 超过之后按格式错误处理
+    static const int MaxHeaderSize = 32 * 1024;
+    // 除了HttpHeader之外最多保存的请求头个数, 多出来的直接忽略
+    static const int MaxExtraHeaders = 32;
+    // 小于这个大小的文件不压缩
+    static const int MinCompressSize = 256;
+    // 一个请求中最多处理的范围个数, 超过之后发送整个文件
+    static const int MaxRanges = 16;
+
     HttpRequest();
     ~HttpRequest();
     // 重置
     void reset();
     // 添加请求头
-    void addHeader(const string key, const string value);
-    // 根据key得到请求头的value
-    string getHeader(const string key);
-    // 解析请求行
-    bool parseRequestLine(Buffer* readBuf);
-    // 解析请求头
-    bool parseRequestHeader(Buffer* readBuf);
-    // 解析http请求协议
-    bool parseHttpRequest(Buffer* readBuf, HttpResponse* response, Buffer* sendBuf, int socket);
+    void addHeader(string_view key, string_view value);
+    // 根据key得到请求头的value, 不区分大小写
+    string_view getHeader(string_view key);
+    inline string_view getHeader(HttpHeader header)
+    {
+        return m_knownHeaders[static_cast<int>(header)];
+    }
+    // 解析请求行, [start, end) 不包含结尾的\r\n
+    bool parseRequestLine(const char* start, const char* end);
+    // 解析一行请求头, colon指向这一行中的第一个冒号, [start, end) 不包含结尾的\r\n
+    bool parseRequestHeader(const char* start, const char* colon, const char* end);
+    // 请求头全部接收到之后一次解析请求行和请求头, 数据不完整时返回true并且状态不变
+    bool parseRequestHead(Buffer* readBuf);
+    // 跳过请求体
+    bool parseRequestBody(Buffer* readBuf);
+    // 解析http请求协议, 每次最多解析一个请求, 格式错误时返回false
+    // 请求头解析完之后立即处理请求并把响应写入sendBuf, 这时string_view指向的数据还有效
+    // 返回true并且状态为ParseReqDone时表示解析并处理完了一个请求, 否则表示数据还不完整
+    bool parseHttpRequest(Buffer* readBuf, HttpResponse* response, Buffer* sendBuf);
     // 处理http请求协议
     bool processHttpRequest(HttpResponse* response);
-    // 解码字符串
-    string decodeMsg(string from);
-    const string getFileType(const string name);
-    static void sendDir(string dirName, Buffer* sendBuf, int cfd);
-    static void sendFile(string dirName, Buffer* sendBuf, int cfd);
-    inline void setMethod(string method)
+    // 把文件中从offset开始的size个字节作为响应体, size小于0表示到文件末尾
+    // 优先使用内存中缓存的内容, 否则零拷贝发送文件
+    void addFileBody(HttpResponse* response, const shared_ptr<const FileMeta>& meta,
+        off_t offset = 0, off_t size = -1);
+    // 检查If-None-Match和If-Modified-Since, 客户端缓存的内容仍然有效时返回true
+    bool isNotModified(const shared_ptr<const FileMeta>& meta);
+    // 添加ETag和Last-Modified, 压缩之后的内容使用弱ETag
+    void addValidators(HttpResponse* response, const shared_ptr<const FileMeta>& meta, bool weak);
+    // 检查If-Range, 文件没有变化时Range才有效
+    bool checkIfRange(const shared_ptr<const FileMeta>& meta);
+    // 解析Range请求头, 有效的范围保存到m_ranges中
+    RangeResult parseRange(off_t fileSize);
+    // 按m_ranges发送文件的一部分(206), 多个范围使用multipart/byteranges
+    void addRangeBody(HttpResponse* response, const shared_ptr<const FileMeta>& meta);
+    // 文件类型是否适合压缩
+    static bool isCompressible(const shared_ptr<const FileMeta>& meta);
+    // 根据Accept-Encoding选择响应体的编码方式
+    ContentEncoding negotiateEncoding();
+    // 按encoding发送压缩之后的文件: 优先使用.gz文件, 否则使用压缩缓存, 无法压缩时返回false
+    bool addCompressedBody(HttpResponse* response, const char* file,
+        const shared_ptr<const FileMeta>& meta, ContentEncoding encoding);
+    // 解码之后的路径是否以'/'开头并且不会访问到文档根目录之外(不含".."段和'\0')
+    static bool isSafePath(string_view path);
+    // 解码字符串, 结果写入to, 复用to已经申请的内存
+    void decodeMsg(string_view from, string& to);
+    // 根据文件名得到MIME类型, 返回的string_view指向静态的存储
+    static string_view getFileType(string_view name);
+    // 把文件的内容写入sendBuf, 由TcpConnection负责发送
+    static void sendFile(string dirName, Buffer* sendBuf);
+    inline string_view getMethod()
     {
-        m_method = method;
+        return m_method;
     }
-    inline void seturl(string url)
+    inline string_view getUrl()
     {
-        m_url = url;
+        return m_url;
     }
-    inline void setVersion(string version)
+    inline string_view getVersion()
     {
-        m_version = version;
+        return m_version;
     }
     // 获取处理状态
     inline PrecessState getState()
@@ -59,17 +137,30 @@ public:
     {
         m_curState = state;
     }
+    // 处理完当前请求之后是否保持连接
+    inline bool isKeepAlive()
+    {
+        return m_keepAlive;
+    }
 
 private:
-    char* splitRequestLine(const char* start, const char* end,
-        const char* sub, function<void(string)> callback);
     int hexToDec(char c);
+    static int findKnownHeader(string_view key);
 
 private:
-    string m_method;
-    string m_url;
-    string m_version;
-    map<string, string> m_reqHeaders;
+    string_view m_method;
+    string_view m_url;
+    string_view m_version;
+    string_view m_knownHeaders[static_cast<int>(HttpHeader::Count)];
+    string_view m_extraHeaders[MaxExtraHeaders][2];
+    int m_extraCount;
+    string m_path;      // 解码之后的文件路径, 重复使用同一块内存
+    string m_sidecar;   // 预先压缩好的.gz文件的路径
+    SmallVector<ByteRange, MaxRanges> m_ranges; // Range请求头中有效的范围
+    DelimiterList m_delims;     // 读缓冲区中 \r \n : 的位置, 相对于请求的起始位置
+    size_t m_delimChecked;      // m_delims中已经检查过是不是请求头结束标记的个数
+    int m_scanned;      // 已经查找过分隔符的字节数, 数据不完整时下次从这里继续找
     PrecessState m_curState;
+    bool m_keepAlive;
+    long m_bodyRemaining; // 请求体中还没有读到的字节数
 };
-
@@ -1,7 +1,14 @@
 #pragma once
 #include "Buffer.h"
-#include <map>
+#include "SmallVector.h"
 #include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 using namespace std;
 
 // 定义状态码枚举
@@ -9,24 +16,56 @@ enum class StatusCode
 {
     Unknown,
     OK = 200,
+    PartialContent = 206,
     MovedPermanently = 301,
     MovedTemporarily = 302,
+    NotModified = 304,
     BadRequest = 400,
-    NotFound = 404
+    NotFound = 404,
+    MethodNotAllowed = 405,
+    RangeNotSatisfiable = 416
+};
+
+// 响应体由多个片段组成, 发送时按顺序处理
+enum class SegmentType:char
+{
+    Memory, // 一块不需要拷贝的内存, 例如静态字符串或者缓存的文件内容
+    File    // 文件中的一段, 使用sendfile发送
+};
+struct ResponseSegment
+{
+    SegmentType type;
+    const char* data;   // Memory: 还没有发送的数据的起始地址
+    int fd;             // File: 文件描述符
+    off_t offset;       // File: 下一次发送的位置
+    off_t size;         // 还没有发送的字节数
+    shared_ptr<const void> holder; // 保证发送完之前data或者fd一直有效, 可以为空
 };
 
 // 定义结构体
 class HttpResponse
 {
 public:
+    // 一次sendmsg最多使用的iovec个数
+    static const int MaxIovec = 16;
+    // 响应头保存在对象内部的内存中, 超过这个大小时才申请内存
+    static const int HeaderStorageSize = 512;
+
     HttpResponse();
     ~HttpResponse();
-    function<void(const string, struct Buffer*, int)> sendDataFunc;
-    // 添加响应头
-    void addHeader(const string key, const string value);
-    // 组织http响应数据
-    void prepareMsg(Buffer* sendBuf, int socket);
-    inline void setFileName(string name)
+    // 重置, 同一个连接上的下一个请求继续使用这个对象
+    void reset();
+    function<void(const string, struct Buffer*)> sendDataFunc;
+    // 添加响应头, 直接序列化成 "key: value\r\n" 的格式
+    void addHeader(string_view key, string_view value);
+    void addHeader(string_view key, long long value);
+    // 添加响应体的片段, 发送的过程中不会拷贝数据
+    void addMemorySegment(const char* data, size_t size, shared_ptr<const void> holder = nullptr);
+    void addFileSegment(int fd, off_t offset, off_t size, shared_ptr<const void> holder = nullptr);
+    // 把状态行和响应头写入sendBuf, sendDataFunc生成的响应体也写入sendBuf
+    void prepareMsg(Buffer* sendBuf);
+    // sendDataFunc读取的文件名, 指向的字符串在prepareMsg之前必须有效, 不拷贝
+    inline void setFileName(string_view name)
     {
         m_fileName = name;
     }
@@ -34,19 +73,42 @@ public:
     {
         m_statusCode = code;
     }
+    // 是否还有没有发送完的响应体片段
+    inline bool hasPendingSegments()
+    {
+        return m_current < m_segments.size();
+    }
+    // 响应体中还没有发送的字节数
+    off_t getPendingSize();
+    // 先发送sendBuf中的数据, 再按顺序发送响应体的片段
+    // 连续的内存片段和sendBuf通过一次sendmsg发送, 文件片段使用sendfile
+    // 返回值: 1 发送完毕, 0 socket暂时不可写, -1 出错
+    int sendData(int socket, Buffer* sendBuf);
+    // 完成模式(io_uring)下由反应堆发送: 把sendBuf和紧跟着的内存片段填入对象中的msghdr, 开头没有内存数据时返回nullptr
+    // 请求完成之前msghdr、sendBuf和片段都不能修改
+    struct msghdr* prepareSendMsg(Buffer* sendBuf);
+    // 按发送完成的字节数扣除sendBuf和内存片段中的数据
+    void consumeSent(Buffer* sendBuf, size_t size);
+    // 使用sendfile发送开头连续的文件片段, 返回值同sendData
+    int sendFileData(int socket);
+private:
+    // 得到预先拼接好的状态行
+    static string_view getStatusLine(StatusCode code);
+    int sendFileSegment(int socket, ResponseSegment& segment);
+    // 用sendBuf和开头连续的内存片段填充vec, 返回使用的个数
+    int fillIovec(Buffer* sendBuf, struct iovec* vec);
+
 private:
     // 状态行: 状态码, 状态描述
     StatusCode m_statusCode;
-    string m_fileName;
-    // 响应头 - 键值对
-    map<string, string> m_headers;
-    // 定义状态码和描述的对应关系
-    const map<int, string> m_info = {
-        {200, "OK"},
-        {301, "MovedPermanently"},
-        {302, "MovedTemporarily"},
-        {400, "BadRequest"},
-        {404, "NotFound"},
-    };
+    string_view m_fileName;
+    // 已经序列化的响应头, 一般的响应头直接写在m_headerStorage中
+    char m_headerStorage[HeaderStorageSize];
+    Buffer m_headerLines;
+    // 响应体的片段, 以及正在发送的片段的下标, 只有multipart/byteranges才会超过4个
+    SmallVector<ResponseSegment, 4> m_segments;
+    size_t m_current = 0;
+    // 完成模式下提交的sendmsg请求使用的参数, 请求完成之前一直有效
+    struct msghdr m_sendMsg;
+    struct iovec m_sendVec[MaxIovec];
 };
-
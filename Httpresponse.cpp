@@ -3,12 +3,27 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <charconv>
 
-HttpResponse::HttpResponse()
+HttpResponse::HttpResponse() : m_headerLines(m_headerStorage, HeaderStorageSize)
+{
+    reset();
+}
+
+void HttpResponse::reset()
 {
     m_statusCode = StatusCode::Unknown;
-    m_headers.clear();
-    m_fileName = string();
+    // 清空不释放内存, 同一个连接上的后续响应不需要重新申请
+    m_headerLines.readPosIncrease(m_headerLines.readableSize());
+    m_fileName = string_view();
+    m_segments.clear();
+    m_current = 0;
     sendDataFunc = nullptr;
 }
 
@@ -16,34 +31,239 @@ HttpResponse::~HttpResponse()
 {
 }
 
-void HttpResponse::addHeader(const string key, const string value)
+string_view HttpResponse::getStatusLine(StatusCode code)
 {
-    if (key.empty() || value.empty())
+    // 定义状态码和描述的对应关系
+    switch (code)
+    {
+    case StatusCode::OK:
+        return "HTTP/1.1 200 OK\r\n";
+    case StatusCode::PartialContent:
+        return "HTTP/1.1 206 PartialContent\r\n";
+    case StatusCode::MovedPermanently:
+        return "HTTP/1.1 301 MovedPermanently\r\n";
+    case StatusCode::MovedTemporarily:
+        return "HTTP/1.1 302 MovedTemporarily\r\n";
+    case StatusCode::NotModified:
+        return "HTTP/1.1 304 NotModified\r\n";
+    case StatusCode::BadRequest:
+        return "HTTP/1.1 400 BadRequest\r\n";
+    case StatusCode::NotFound:
+        return "HTTP/1.1 404 NotFound\r\n";
+    case StatusCode::MethodNotAllowed:
+        return "HTTP/1.1 405 MethodNotAllowed\r\n";
+    case StatusCode::RangeNotSatisfiable:
+        return "HTTP/1.1 416 RangeNotSatisfiable\r\n";
+    default:
+        return "HTTP/1.1 500 InternalServerError\r\n";
+    }
+}
+
+void HttpResponse::addMemorySegment(const char* data, size_t size, shared_ptr<const void> holder)
+{
+    if (size == 0)
+    {
+        return;
+    }
+    m_segments.push_back(ResponseSegment{ SegmentType::Memory, data, -1, 0, static_cast<off_t>(size), move(holder) });
+}
+
+void HttpResponse::addFileSegment(int fd, off_t offset, off_t size, shared_ptr<const void> holder)
+{
+    if (size <= 0)
     {
         return;
     }
-    m_headers.insert(make_pair(key, value));
+    m_segments.push_back(ResponseSegment{ SegmentType::File, nullptr, fd, offset, size, move(holder) });
+}
+
+off_t HttpResponse::getPendingSize()
+{
+    off_t size = 0;
+    for (size_t i = m_current; i < m_segments.size(); ++i)
+    {
+        size += m_segments[i].size;
+    }
+    return size;
+}
+
+int HttpResponse::sendFileSegment(int socket, ResponseSegment& segment)
+{
+    while (segment.size > 0)
+    {
+        // sendfile会更新offset, socket的发送缓冲区满了之后返回EAGAIN, 等待写事件之后从这里继续
+        ssize_t ret = sendfile(socket, segment.fd, &segment.offset, segment.size);
+        if (ret > 0)
+        {
+            segment.size -= ret;
+            continue;
+        }
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return 0;
+        }
+        if (ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        // 出错或者文件被截断了(ret == 0), 已经发出的Content-length无法再满足
+        return -1;
+    }
+    return 1;
+}
+
+int HttpResponse::fillIovec(Buffer* sendBuf, struct iovec* vec)
+{
+    // sendBuf中的数据(状态行、响应头)和紧跟着的内存片段放在一起, 一次系统调用发送
+    int count = 0;
+    int bufSize = sendBuf->readableSize();
+    if (bufSize > 0)
+    {
+        vec[count].iov_base = sendBuf->data();
+        vec[count].iov_len = bufSize;
+        ++count;
+    }
+    for (size_t i = m_current; i < m_segments.size() && count < MaxIovec; ++i)
+    {
+        if (m_segments[i].type != SegmentType::Memory)
+        {
+            break;
+        }
+        vec[count].iov_base = const_cast<char*>(m_segments[i].data);
+        vec[count].iov_len = m_segments[i].size;
+        ++count;
+    }
+    return count;
 }
 
-void HttpResponse::prepareMsg(Buffer* sendBuf, int socket)
+void HttpResponse::consumeSent(Buffer* sendBuf, size_t size)
 {
-    // 状态行
-    char tmp[1024] = { 0 };
-    int code = static_cast<int>(m_statusCode);
-    sprintf(tmp, "HTTP/1.1 %d %s\r\n", code, m_info.at(code).data());
-    sendBuf->appendString(tmp);
-    // 响应头
-    for (auto it = m_headers.begin(); it != m_headers.end(); ++it)
+    // 按顺序扣除已经发送的数据, 只发送了一部分时下次从中间继续
+    int bufSize = sendBuf->readableSize();
+    if (bufSize > 0)
     {
-        sprintf(tmp, "%s: %s\r\n", it->first.data(), it->second.data());
-        sendBuf->appendString(tmp);
+        int sent = size < (size_t)bufSize ? static_cast<int>(size) : bufSize;
+        sendBuf->readPosIncrease(sent);
+        size -= sent;
     }
+    while (size > 0)
+    {
+        ResponseSegment& segment = m_segments[m_current];
+        off_t sent = (off_t)size < segment.size ? (off_t)size : segment.size;
+        segment.data += sent;
+        segment.size -= sent;
+        size -= sent;
+        if (segment.size == 0)
+        {
+            ++m_current;
+        }
+    }
+}
+
+struct msghdr* HttpResponse::prepareSendMsg(Buffer* sendBuf)
+{
+    int count = fillIovec(sendBuf, m_sendVec);
+    if (count == 0)
+    {
+        return nullptr;
+    }
+    memset(&m_sendMsg, 0, sizeof(m_sendMsg));
+    m_sendMsg.msg_iov = m_sendVec;
+    m_sendMsg.msg_iovlen = count;
+    return &m_sendMsg;
+}
+
+int HttpResponse::sendFileData(int socket)
+{
+    // 只发送开头连续的文件片段, 遇到内存片段时返回, 由调用者提交
+    while (m_current < m_segments.size() && m_segments[m_current].type == SegmentType::File)
+    {
+        int ret = sendFileSegment(socket, m_segments[m_current]);
+        if (ret != 1)
+        {
+            return ret;
+        }
+        ++m_current;
+    }
+    return 1;
+}
+
+int HttpResponse::sendData(int socket, Buffer* sendBuf)
+{
+    while (true)
+    {
+        // 1. sendBuf和内存片段通过一次sendmsg发送
+        struct iovec vec[MaxIovec];
+        int count = fillIovec(sendBuf, vec);
+        if (count > 0)
+        {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = vec;
+            msg.msg_iovlen = count;
+            ssize_t ret = sendmsg(socket, &msg, MSG_NOSIGNAL);
+            if (ret == -1)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return 0;
+                }
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return -1;
+            }
+            consumeSent(sendBuf, ret);
+            continue;
+        }
+        // 2. 文件片段使用sendfile零拷贝发送
+        if (m_current < m_segments.size())
+        {
+            int ret = sendFileSegment(socket, m_segments[m_current]);
+            if (ret != 1)
+            {
+                return ret;
+            }
+            ++m_current;
+            continue;
+        }
+        return 1;
+    }
+}
+
+void HttpResponse::addHeader(string_view key, string_view value)
+{
+    if (key.empty() || value.empty())
+    {
+        return;
+    }
+    m_headerLines.appendString(key.data(), key.size());
+    m_headerLines.appendString(": ", 2);
+    m_headerLines.appendString(value.data(), value.size());
+    m_headerLines.appendString("\r\n", 2);
+}
+
+void HttpResponse::addHeader(string_view key, long long value)
+{
+    // to_chars不申请内存, 也不依赖locale
+    char tmp[32];
+    auto result = to_chars(tmp, tmp + sizeof(tmp), value);
+    addHeader(key, string_view(tmp, result.ptr - tmp));
+}
+
+void HttpResponse::prepareMsg(Buffer* sendBuf)
+{
+    // 状态行和响应头都已经是序列化好的字符串, 直接拷贝到sendBuf
+    string_view statusLine = getStatusLine(m_statusCode);
+    sendBuf->appendString(statusLine.data(), statusLine.size());
+    sendBuf->appendString(m_headerLines.data(), m_headerLines.readableSize());
     // 空行
-    sendBuf->appendString("\r\n");
-#ifndef MSG_SEND_AUTO
-    sendBuf->sendData(socket);
-#endif
+    sendBuf->appendString("\r\n", 2);
 
-    // 回复的数据
-    sendDataFunc(m_fileName, sendBuf, socket);
+    // sendDataFunc生成的响应体写入sendBuf, 其余的响应体在m_segments中, 发送时不再拷贝
+    if (sendDataFunc)
+    {
+        sendDataFunc(string(m_fileName), sendBuf);
+    }
 }
@@ -0,0 +1,562 @@
+#include "Dispatcher.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "IoUringDispatcher.h"
+#include "Buffer.h"
+
+// 不需要处理的完成事件(取消请求、关闭fd、超时)使用的user_data
+static const uint64_t IgnoreData = UINT64_MAX;
+// user_data: 高32位是序号, 之后4位是请求的种类, 低28位是fd
+static const uint64_t FdMask = (1 << 28) - 1;
+
+static uint64_t makeUserData(int fd, int op, uint32_t seq)
+{
+    return (uint64_t)seq << 32 | (uint64_t)op << 28 | ((uint32_t)fd & FdMask);
+}
+
+IoUringDispatcher::IoUringDispatcher(EventLoop* evloop) : Dispatcher(evloop)
+{
+    m_ringFd = -1;
+    m_extArg = false;
+    m_sqRing = m_cqRing = MAP_FAILED;
+    m_sqes = (struct io_uring_sqe*)MAP_FAILED;
+    m_sqRingSize = m_cqRingSize = m_sqesSize = 0;
+    m_fds.resize(m_initNode);
+    m_name = "IoUring";
+    if (!setup() && m_ringFd != -1)
+    {
+        close(m_ringFd);
+        m_ringFd = -1;
+    }
+}
+
+IoUringDispatcher::~IoUringDispatcher()
+{
+    // 最后删除的fd的CLOSE请求可能还没有提交
+    if (m_ringFd != -1)
+    {
+        flush();
+    }
+    if (m_sqes != MAP_FAILED)
+    {
+        munmap(m_sqes, m_sqesSize);
+    }
+    if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+    {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    if (m_sqRing != MAP_FAILED)
+    {
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    if (m_ringFd != -1)
+    {
+        close(m_ringFd);
+    }
+}
+
+bool IoUringDispatcher::setup()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // 每个连接同时最多有接收、发送和poll三个请求, 完成队列留得大一些, 一轮中大量连接同时完成时也放得下
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = m_initNode * 4;
+    m_ringFd = syscall(__NR_io_uring_setup, m_initNode, &params);
+    if (m_ringFd == -1)
+    {
+        perror("io_uring_setup");
+        return false;
+    }
+    m_extArg = params.features & IORING_FEAT_EXT_ARG;
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // 5.4之后提交队列和完成队列可以通过一次mmap映射
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+    {
+        m_sqRingSize = m_cqRingSize = max(m_sqRingSize, m_cqRingSize);
+    }
+    m_sqRing = mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+    if (m_sqRing == MAP_FAILED)
+    {
+        perror("mmap io_uring sq");
+        return false;
+    }
+    m_cqRing = singleMmap ? m_sqRing :
+        mmap(NULL, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_CQ_RING);
+    if (m_cqRing == MAP_FAILED)
+    {
+        perror("mmap io_uring cq");
+        return false;
+    }
+    m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = (struct io_uring_sqe*)mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED)
+    {
+        perror("mmap io_uring sqes");
+        return false;
+    }
+    char* sq = static_cast<char*>(m_sqRing);
+    char* cq = static_cast<char*>(m_cqRing);
+    m_sqHead = (unsigned*)(sq + params.sq_off.head);
+    m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+    m_sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    m_sqEntries = params.sq_entries;
+    m_sqLocalTail = *m_sqTail;
+    // 提交队列的第i项固定使用第i个sqe
+    unsigned* array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < m_sqEntries; ++i)
+    {
+        array[i] = i;
+    }
+    m_cqHead = (unsigned*)(cq + params.cq_off.head);
+    m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+    m_cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    // 5.7之后没有数据的socket上的RECV请求会等待数据到达, 而不是立即返回EAGAIN
+    m_completionBased = (params.features & IORING_FEAT_FAST_POLL) && probeOps();
+    if (!m_completionBased)
+    {
+        printf("io_uring does not support socket operations, using POLL_ADD\n");
+    }
+    return true;
+}
+
+bool IoUringDispatcher::probeOps()
+{
+    // io_uring_probe后面跟着每种请求的信息, 只在启动时查询一次
+    const int maxOps = 256;
+    vector<char> memory(sizeof(struct io_uring_probe) + maxOps * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe* probe = (struct io_uring_probe*)memory.data();
+    if (syscall(__NR_io_uring_register, m_ringFd, IORING_REGISTER_PROBE, probe, maxOps) == -1)
+    {
+        return false;
+    }
+    const int ops[] = { IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_ACCEPT, IORING_OP_CLOSE, IORING_OP_ASYNC_CANCEL };
+    for (int op : ops)
+    {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct io_uring_sqe* IoUringDispatcher::getSqe()
+{
+    unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if (m_sqLocalTail - head >= m_sqEntries)
+    {
+        // 提交队列满了, 先提交, 不等待完成事件
+        enter(0, 0, NULL, 0);
+    }
+    struct io_uring_sqe* sqe = &m_sqes[m_sqLocalTail & m_sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++m_sqLocalTail;
+    return sqe;
+}
+
+int IoUringDispatcher::enter(unsigned waitNr, unsigned flags, void* arg, size_t argSize)
+{
+    // 写完sqe之后再更新队尾, 内核才能看到完整的请求
+    __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+    unsigned submit = m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    int ret = syscall(__NR_io_uring_enter, m_ringFd, submit, waitNr, flags, arg, argSize);
+    if (ret == -1 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN)
+    {
+        perror("io_uring_enter");
+        exit(0);
+    }
+    return ret;
+}
+
+IoUringDispatcher::FdState& IoUringDispatcher::getState(int fd)
+{
+    if (fd >= (int)m_fds.size())
+    {
+        m_fds.resize(max(fd + 1, (int)m_fds.size() * 2));
+    }
+    return m_fds[fd];
+}
+
+int IoUringDispatcher::pollEvents(const FdState& state)
+{
+    int events = 0;
+    int wanted = state.channel->getEvent();
+    // 连接的数据由RECV接收, 只在等待sendfile时检测可写; 监听fd只使用ACCEPT
+    if (wanted & (int)FDEvent::ReadEvent && state.mode == FdMode::Poll)
+    {
+        events |= POLLIN;
+    }
+    if (wanted & (int)FDEvent::WriteEvent && state.mode != FdMode::Acceptor && !state.sending)
+    {
+        events |= POLLOUT;
+    }
+    return events;
+}
+
+void IoUringDispatcher::update(int fd)
+{
+    FdState& state = m_fds[fd];
+    if (state.mode != FdMode::Poll && !state.receiving && state.channel->getEvent() & (int)FDEvent::ReadEvent)
+    {
+        if (state.mode == FdMode::Stream)
+        {
+            submitRecv(fd);
+        }
+        else
+        {
+            submitAccept(fd);
+        }
+    }
+    int events = pollEvents(state);
+    if (events == state.events && (state.armed || events == 0))
+    {
+        return;
+    }
+    cancelPoll(fd);
+    state.events = events;
+    if (events != 0)
+    {
+        armPoll(fd);
+    }
+}
+
+void IoUringDispatcher::armPoll(int fd)
+{
+    FdState& state = m_fds[fd];
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = state.events;
+    sqe->user_data = makeUserData(fd, (int)OpType::Poll, state.pollSeq);
+    state.armed = true;
+}
+
+void IoUringDispatcher::cancelPoll(int fd)
+{
+    FdState& state = m_fds[fd];
+    if (state.armed)
+    {
+        struct io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = makeUserData(fd, (int)OpType::Poll, state.pollSeq);
+        sqe->user_data = IgnoreData;
+        state.armed = false;
+    }
+    // 被取消的请求仍然会产生一个完成事件, 序号变化之后它会被忽略
+    ++state.pollSeq;
+}
+
+void IoUringDispatcher::submitRecv(int fd)
+{
+    FdState& state = m_fds[fd];
+    // 数据直接写入读缓冲区的空闲部分, 不需要再拷贝
+    Buffer* buf = state.channel->getReadBuffer();
+    state.recvTarget = buf->prepareWrite(MinRecvSize);
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)state.recvTarget;
+    sqe->len = buf->writeableSize();
+    sqe->user_data = makeUserData(fd, (int)OpType::Recv, state.ioSeq);
+    state.receiving = true;
+}
+
+void IoUringDispatcher::submitAccept(int fd)
+{
+    FdState& state = m_fds[fd];
+    // 和accept4(lfd, NULL, NULL, SOCK_NONBLOCK)相同, 不需要对方的地址
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = makeUserData(fd, (int)OpType::Accept, state.ioSeq);
+    state.receiving = true;
+}
+
+void IoUringDispatcher::cancelIo(int fd, OpType op)
+{
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = makeUserData(fd, (int)op, m_fds[fd].ioSeq);
+    sqe->user_data = IgnoreData;
+}
+
+int IoUringDispatcher::add()
+{
+    int fd = m_channel->getSocket();
+    FdState& state = getState(fd);
+    cancelPoll(fd);
+    state.channel = m_channel;
+    state.mode = FdMode::Poll;
+    if (m_completionBased && m_channel->isAcceptor())
+    {
+        state.mode = FdMode::Acceptor;
+    }
+    else if (m_completionBased && m_channel->getReadBuffer() != nullptr)
+    {
+        state.mode = FdMode::Stream;
+    }
+    state.events = 0;
+    update(fd);
+    return 0;
+}
+
+int IoUringDispatcher::remove()
+{
+    int fd = m_channel->getSocket();
+    FdState& state = getState(fd);
+    if (state.closing)
+    {
+        // 已经在等待收发请求完成了
+        return 0;
+    }
+    bool armed = state.armed;
+    cancelPoll(fd);
+    state.events = 0;
+    if (state.receiving)
+    {
+        cancelIo(fd, state.mode == FdMode::Stream ? OpType::Recv : OpType::Accept);
+    }
+    if (state.sending)
+    {
+        cancelIo(fd, OpType::Send);
+    }
+    if (state.mode == FdMode::Stream && (state.receiving || state.sending))
+    {
+        // 请求完成之前内核还会读写连接的缓冲区, 等完成事件都收到之后再释放连接
+        state.closing = true;
+        return 0;
+    }
+    // 监听fd上被取消的ACCEPT没有引用任何内存, 完成事件按序号忽略
+    state.channel = nullptr;
+    state.receiving = false;
+    ++state.ioSeq;
+    // 没有完成的poll请求引用着fd对应的文件, 取消请求提交之前close(fd)不会真正关闭socket
+    // 反应堆可能马上就要退出了, 这里立即提交, 不等下一次dispatch; 完成模式下关闭fd的请求也在队列中, 会按顺序提交
+    if (armed && !m_completionBased)
+    {
+        enter(0, 0, NULL, 0);
+    }
+    // 通过 channel 释放对应的 TcpConnection 资源, 没有destroyCallback的channel由EventLoop释放
+    if (m_channel->destroyCallback)
+    {
+        m_channel->destroyCallback(const_cast<void*>(m_channel->getArg()));
+    }
+    return 0;
+}
+
+void IoUringDispatcher::finishClose(int fd)
+{
+    FdState& state = m_fds[fd];
+    Channel* channel = state.channel;
+    state.channel = nullptr;
+    state.closing = false;
+    ++state.ioSeq;
+    channel->destroyCallback(const_cast<void*>(channel->getArg()));
+}
+
+int IoUringDispatcher::modify()
+{
+    int fd = m_channel->getSocket();
+    FdState& state = getState(fd);
+    if (state.channel != m_channel || state.closing)
+    {
+        return 0;
+    }
+    update(fd);
+    return 0;
+}
+
+int IoUringDispatcher::sendMsg(const struct msghdr* msg)
+{
+    int fd = m_channel->getSocket();
+    FdState& state = getState(fd);
+    if (state.channel != m_channel || state.mode != FdMode::Stream || state.sending || state.closing)
+    {
+        return -1;
+    }
+    // 发送完成时会调用写回调, 不再需要检测可写事件
+    state.sending = true;
+    update(fd);
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = makeUserData(fd, (int)OpType::Send, state.ioSeq);
+    return 0;
+}
+
+void IoUringDispatcher::closeFd(int fd)
+{
+    if (!m_completionBased)
+    {
+        close(fd);
+        return;
+    }
+    // 之前对这个fd的请求已经在队列中了, 内核按顺序取出
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = IgnoreData;
+}
+
+void IoUringDispatcher::flush()
+{
+    if (m_sqLocalTail != __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE))
+    {
+        enter(0, 0, NULL, 0);
+    }
+}
+
+void IoUringDispatcher::complete(const struct io_uring_cqe& cqe)
+{
+    int fd = (int)(cqe.user_data & FdMask);
+    OpType op = (OpType)((cqe.user_data >> 28) & 0xF);
+    uint32_t seq = cqe.user_data >> 32;
+    int res = cqe.res;
+    if (fd >= (int)m_fds.size())
+    {
+        return;
+    }
+    FdState& state = m_fds[fd];
+    int events = 0;
+    if (op == OpType::Poll)
+    {
+        if (state.pollSeq != seq)
+        {
+            // fd已经被删除或者修改过事件了
+            return;
+        }
+        state.armed = false;
+        // 出错或者对方断开了连接, 交给读回调处理, 和epoll中的处理方式一样; 连接只检测可写, 交给写回调发送时处理
+        if (state.mode == FdMode::Poll && (res < 0 || res & (POLLERR | POLLHUP | POLLIN)))
+        {
+            events |= (int)FDEvent::ReadEvent;
+        }
+        if ((state.mode == FdMode::Stream && res != 0) || (res > 0 && res & POLLOUT))
+        {
+            events |= (int)FDEvent::WriteEvent;
+        }
+    }
+    else
+    {
+        if (state.ioSeq != seq)
+        {
+            // 被取消的ACCEPT已经建立了连接, 没有人会使用它
+            if (op == OpType::Accept && res >= 0)
+            {
+                close(res);
+            }
+            return;
+        }
+        if (op == OpType::Send)
+        {
+            state.sending = false;
+        }
+        else
+        {
+            state.receiving = false;
+        }
+        if (state.closing)
+        {
+            if (!state.receiving && !state.sending)
+            {
+                finishClose(fd);
+            }
+            return;
+        }
+        if (res == -EAGAIN || res == -EINTR)
+        {
+            // 没有完成任何操作, 发送按0字节处理, 由写回调重新提交
+            if (op != OpType::Send)
+            {
+                update(fd);
+                return;
+            }
+            res = 0;
+        }
+        if (op == OpType::Recv && res > 0)
+        {
+            state.channel->getReadBuffer()->commitWrite(state.recvTarget, res);
+        }
+        state.channel->setResult(res);
+        events = op == OpType::Send ? (int)FDEvent::WriteEvent : (int)FDEvent::ReadEvent;
+    }
+    m_evLoop->eventActive(fd, events);
+    // 回调中没有删除这个fd时按新的事件重新提交请求, 数据没有读完时下一轮会立即再次完成
+    // 回调中可能添加了更大的fd使m_fds扩容, 不能再使用之前的引用
+    FdState& current = m_fds[fd];
+    if (current.channel != nullptr && !current.closing)
+    {
+        update(fd);
+    }
+}
+
+int IoUringDispatcher::dispatch(int timeout)
+{
+    // 提交队列中积累的请求和等待完成事件合并为一次系统调用
+    // 完成队列中还有事件时不等待
+    bool hasReady = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE) != *m_cqHead;
+    unsigned waitNr = timeout != 0 && !hasReady ? 1 : 0;
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    if (waitNr > 0 && timeout > 0)
+    {
+        m_timeout.tv_sec = timeout / 1000;
+        m_timeout.tv_nsec = (timeout % 1000) * 1000000LL;
+        if (m_extArg)
+        {
+            struct io_uring_getevents_arg arg;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)(uintptr_t)&m_timeout;
+            enter(waitNr, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        }
+        else
+        {
+            // 超时或者有一个其他的完成事件时结束, 不会留下多余的定时器
+            struct io_uring_sqe* sqe = getSqe();
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)(uintptr_t)&m_timeout;
+            sqe->len = 1;
+            sqe->off = 1;
+            sqe->user_data = IgnoreData;
+            enter(waitNr, flags, NULL, 0);
+        }
+    }
+    else
+    {
+        enter(waitNr, flags, NULL, 0);
+    }
+
+    // 先取出全部的完成事件并归还完成队列的空间, 回调中提交的请求可能很快就会完成
+    unsigned head = *m_cqHead;
+    unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    m_ready.clear();
+    for (; head != tail; ++head)
+    {
+        m_ready.push_back(m_cqes[head & m_cqMask]);
+    }
+    __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    for (struct io_uring_cqe& cqe : m_ready)
+    {
+        if (cqe.user_data != IgnoreData)
+        {
+            complete(cqe);
+        }
+    }
+    return 0;
+}
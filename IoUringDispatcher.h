@@ -0,0 +1,124 @@
+#pragma once
+#include "Channel.h"
+#include "EventLoop.h"
+#include "Dispatcher.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <linux/io_uring.h>
+using namespace std;
+
+// 基于io_uring的Dispatcher, 直接使用系统调用, 不依赖liburing
+// 完成模式: 连接的数据由RECV请求直接接收到channel的读缓冲区, 响应由SENDMSG请求发送, 监听fd使用ACCEPT请求, fd通过CLOSE请求关闭
+// 请求完成之后调用channel的回调, 结果通过channel->getResult()取得; 其他的fd(eventfd、signalfd等)仍然使用一次性的POLL_ADD请求
+// 内核不支持这些请求时所有的fd都使用POLL_ADD, 效果和水平触发的epoll相同, 由回调自己读写fd
+// 所有的请求都只是写入提交队列, 和下一次等待事件合并成一次io_uring_enter
+class IoUringDispatcher : public Dispatcher
+{
+public:
+    IoUringDispatcher(EventLoop* evloop);
+    ~IoUringDispatcher();
+    // 内核不支持或者禁用了io_uring时返回false, 这时由EventLoop改用epoll
+    inline bool isValid()
+    {
+        return m_ringFd != -1;
+    }
+    // 添加
+    int add() override;
+    // 删除
+    int remove() override;
+    // 修改
+    int modify() override;
+    // 事件监测
+    int dispatch(int timeout = -1) override; // 单位: ms, -1表示一直等待
+    int sendMsg(const struct msghdr* msg) override;
+    void closeFd(int fd) override;
+    void flush() override;
+
+private:
+    // 请求的种类, 和fd、序号一起作为请求的user_data
+    enum class OpType:char
+    {
+        Poll,
+        Recv,
+        Accept,
+        Send
+    };
+    // fd的处理方式, 在add()时根据channel的设置决定
+    enum class FdMode:char
+    {
+        Poll,       // 只检测事件, 回调自己读写
+        Stream,     // 连接: RECV接收数据, SENDMSG发送, 等待sendfile时用POLL_ADD检测可写
+        Acceptor    // 监听fd: ACCEPT
+    };
+    // fd当前的请求, 序号不同的完成事件已经失效了
+    struct FdState
+    {
+        Channel* channel = nullptr;
+        FdMode mode = FdMode::Poll;
+        uint32_t pollSeq = 0;   // poll请求的序号, 修改检测的事件时变化
+        uint32_t ioSeq = 0;     // 收发请求的序号, fd被删除时变化
+        int events = 0;         // poll请求检测的事件 POLLIN | POLLOUT
+        bool armed = false;     // poll请求已经提交, 还没有完成
+        bool receiving = false; // RECV或者ACCEPT请求还没有完成
+        bool sending = false;   // SENDMSG请求还没有完成
+        bool closing = false;   // 已经删除, 等收发请求都完成之后再释放连接
+        char* recvTarget = nullptr; // RECV请求写入的位置
+    };
+    // 创建io_uring并映射提交队列和完成队列, 失败时返回false
+    bool setup();
+    // 内核是否支持完成模式需要的请求
+    bool probeOps();
+    // 取出一个空闲的提交队列项, 队列满了时先把已有的请求提交给内核
+    struct io_uring_sqe* getSqe();
+    // 按channel当前的事件提交需要的请求
+    void update(int fd);
+    // 为fd提交一个POLL_ADD请求
+    void armPoll(int fd);
+    // 取消fd上还没有完成的poll请求, 之后收到的完成事件都会被忽略
+    void cancelPoll(int fd);
+    void submitRecv(int fd);
+    void submitAccept(int fd);
+    // 取消fd上还没有完成的收发请求, 被取消的请求仍然会产生完成事件
+    void cancelIo(int fd, OpType op);
+    // 连接的收发请求都完成了, 释放连接
+    void finishClose(int fd);
+    // 处理一个完成事件
+    void complete(const struct io_uring_cqe& cqe);
+    // 提交请求, 设置了IORING_ENTER_GETEVENTS时等待waitNr个完成事件
+    int enter(unsigned waitNr, unsigned flags, void* arg, size_t argSize);
+    // channel的事件转换为poll的事件
+    int pollEvents(const FdState& state);
+    FdState& getState(int fd);
+
+private:
+    int m_ringFd;
+    bool m_extArg;      // 内核支持在io_uring_enter中直接传入超时时长(5.11)
+    // 提交队列
+    unsigned* m_sqHead;
+    unsigned* m_sqTail;
+    unsigned m_sqMask;
+    unsigned m_sqEntries;
+    unsigned m_sqLocalTail; // 已经写入但还没有提交的请求在m_sqLocalTail和*m_sqTail之间
+    struct io_uring_sqe* m_sqes;
+    // 完成队列
+    unsigned* m_cqHead;
+    unsigned* m_cqTail;
+    unsigned m_cqMask;
+    struct io_uring_cqe* m_cqes;
+    // mmap映射的内存
+    void* m_sqRing;
+    size_t m_sqRingSize;
+    void* m_cqRing;
+    size_t m_cqRingSize;
+    size_t m_sqesSize;
+    // 没有m_extArg时通过IORING_OP_TIMEOUT实现超时, 时长在提交时才被内核读取
+    struct __kernel_timespec m_timeout;
+    // 以fd为下标
+    vector<FdState> m_fds;
+    // 一次从完成队列中取出的事件, 先取完再处理回调, 回调中可以继续提交请求
+    vector<struct io_uring_cqe> m_ready;
+    const unsigned m_initNode = 1024;
+    // RECV请求至少使用的缓冲区空间
+    static const int MinRecvSize = 4096;
+};
@@ -0,0 +1,89 @@
+#include "MemoryPool.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+
+// 内存块按缓存行对齐, 不同连接的数据不会共享同一个缓存行
+static const size_t BlockAlign = 64;
+// mbind的策略, 和<numaif.h>中的MPOL_PREFERRED相同, 直接使用系统调用不需要链接libnuma
+static const int MpolPreferred = 1;
+
+MemoryPool::MemoryPool(size_t blockSize, int blocksPerSlab)
+{
+    m_blockSize = (blockSize + BlockAlign - 1) / BlockAlign * BlockAlign;
+    m_blocksPerSlab = blocksPerSlab > 0 ? blocksPerSlab : 1;
+    // slab的大小是页的整数倍
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    m_slabSize = (m_blockSize * m_blocksPerSlab + pageSize - 1) / pageSize * pageSize;
+    m_freeList = nullptr;
+    m_returned.store(nullptr, memory_order_relaxed);
+    m_numaNode = -1;
+}
+
+MemoryPool::~MemoryPool()
+{
+    for (void* slab : m_slabs)
+    {
+        munmap(slab, m_slabSize);
+    }
+}
+
+bool MemoryPool::addSlab()
+{
+    // 直接使用mmap, 页在第一次访问时才分配物理内存
+    void* slab = mmap(nullptr, m_slabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+    // 连接可能在主线程中创建, 内存块中的空闲链表节点是主线程写入的, 在此之前指定节点才能让物理页分配在反应堆的节点上
+    if (m_numaNode >= 0 && m_numaNode < 64)
+    {
+        unsigned long nodeMask = 1UL << m_numaNode;
+        if (syscall(SYS_mbind, slab, m_slabSize, MpolPreferred, &nodeMask, 64, 0) == -1)
+        {
+            perror("mbind");
+        }
+    }
+    m_slabs.push_back(slab);
+    // 倒序放入空闲链表, 分配时按地址从低到高取出
+    char* base = static_cast<char*>(slab);
+    for (int i = m_blocksPerSlab - 1; i >= 0; --i)
+    {
+        FreeNode* node = reinterpret_cast<FreeNode*>(base + i * m_blockSize);
+        node->next = m_freeList;
+        m_freeList = node;
+    }
+    return true;
+}
+
+void* MemoryPool::allocate()
+{
+    if (m_freeList == nullptr)
+    {
+        // 一次取走整个栈, 只有分配的线程会取, 不会出现ABA问题
+        m_freeList = m_returned.exchange(nullptr, memory_order_acquire);
+    }
+    if (m_freeList == nullptr && !addSlab())
+    {
+        return nullptr;
+    }
+    FreeNode* node = m_freeList;
+    m_freeList = node->next;
+    return node;
+}
+
+void MemoryPool::deallocate(void* ptr)
+{
+    if (ptr == nullptr)
+    {
+        return;
+    }
+    FreeNode* node = static_cast<FreeNode*>(ptr);
+    node->next = m_returned.load(memory_order_relaxed);
+    while (!m_returned.compare_exchange_weak(node->next, node, memory_order_release, memory_order_relaxed))
+    {
+    }
+}
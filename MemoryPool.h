@@ -0,0 +1,46 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+#include <atomic>
+using namespace std;
+
+// 固定大小的内存块池, 每次向系统申请一整块slab, 切分成多个内存块通过空闲链表分配
+// 释放的内存块放回空闲链表供下次使用, slab在内存池析构之前不会还给系统
+// 连接只由一个线程创建(主线程或者反应堆自己的线程), 都在反应堆的线程中释放, 分配和释放都不加锁:
+// 分配的线程独占自己的空闲链表, 释放的内存块通过CAS压入一个无锁的栈, 分配时空闲链表用完再一次取走整个栈
+class MemoryPool
+{
+public:
+    MemoryPool(size_t blockSize, int blocksPerSlab = 16);
+    ~MemoryPool();
+    // 分配一个内存块, 大小为blockSize, 失败时返回nullptr
+    // 同一时刻只能有一个线程调用(接受这个反应堆的连接的线程)
+    void* allocate();
+    // 释放allocate()得到的内存块, 可以在任意线程中调用
+    void deallocate(void* ptr);
+    // 之后申请的slab优先使用这个NUMA节点上的内存, -1表示不指定(由第一次访问的线程决定)
+    inline void setNumaNode(int node)
+    {
+        m_numaNode = node;
+    }
+
+private:
+    // 申请一个新的slab, 把其中的内存块都放进空闲链表
+    bool addSlab();
+
+private:
+    // 空闲的内存块中直接存放下一个空闲块的地址
+    struct FreeNode
+    {
+        FreeNode* next;
+    };
+    size_t m_blockSize;
+    int m_blocksPerSlab;
+    size_t m_slabSize;
+    vector<void*> m_slabs;
+    // 分配的线程独占的空闲链表
+    FreeNode* m_freeList;
+    // 释放之后还没有被分配的线程取走的内存块
+    atomic<FreeNode*> m_returned;
+    int m_numaNode;
+};
@@ -0,0 +1,231 @@
+#include "MimeTypes.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <fstream>
+#include <sstream>
+
+struct MimeEntry
+{
+    string_view ext;    // 小写, 不带'.'
+    string_view type;
+};
+
+static constexpr string_view DefaultType = "text/plain; charset=utf-8";
+
+static constexpr MimeEntry MimeTable[] = {
+    { "html", "text/html; charset=utf-8" },
+    { "htm", "text/html; charset=utf-8" },
+    { "txt", "text/plain; charset=utf-8" },
+    { "css", "text/css" },
+    { "js", "text/javascript; charset=utf-8" },
+    { "json", "application/json" },
+    { "xml", "application/xml" },
+    { "svg", "image/svg+xml" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "png", "image/png" },
+    { "webp", "image/webp" },
+    { "ico", "image/x-icon" },
+    { "au", "audio/basic" },
+    { "wav", "audio/wav" },
+    { "midi", "audio/midi" },
+    { "mid", "audio/midi" },
+    { "mp3", "audio/mpeg" },
+    { "ogg", "application/ogg" },
+    { "avi", "video/x-msvideo" },
+    { "mov", "video/quicktime" },
+    { "qt", "video/quicktime" },
+    { "mpeg", "video/mpeg" },
+    { "mpe", "video/mpeg" },
+    { "mp4", "video/mp4" },
+    { "webm", "video/webm" },
+    { "vrml", "model/vrml" },
+    { "wrl", "model/vrml" },
+    { "pac", "application/x-ns-proxy-autoconfig" },
+    { "pdf", "application/pdf" },
+    { "wasm", "application/wasm" },
+    { "woff2", "font/woff2" },
+};
+static constexpr int EntryCount = sizeof(MimeTable) / sizeof(MimeTable[0]);
+// 哈希表的大小是2的幂, 取下标只需要一次移位
+static constexpr uint32_t TableBits = 7;
+static constexpr uint32_t TableSize = 1u << TableBits;
+static_assert(EntryCount < (int)TableSize, "MimeTable is too large");
+
+// 带种子的FNV-1a哈希
+static constexpr uint32_t hashExt(string_view ext, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : ext)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// FNV的乘法只会把低位扩散到高位, 取高位作为下标, 种子才能真正改变分布
+static constexpr uint32_t slotOf(string_view ext, uint32_t seed)
+{
+    return hashExt(ext, seed) >> (32 - TableBits);
+}
+
+// 这个种子下所有的扩展名是否落在不同的位置
+static constexpr bool isPerfect(uint32_t seed)
+{
+    bool used[TableSize] = {};
+    for (const MimeEntry& entry : MimeTable)
+    {
+        uint32_t index = slotOf(entry.ext, seed);
+        if (used[index])
+        {
+            return false;
+        }
+        used[index] = true;
+    }
+    return true;
+}
+
+// 编译期依次尝试, 找到第一个没有冲突的种子
+static constexpr uint32_t findSeed()
+{
+    uint32_t seed = 0;
+    while (!isPerfect(seed))
+    {
+        ++seed;
+    }
+    return seed;
+}
+static constexpr uint32_t Seed = findSeed();
+
+// 哈希表中保存MimeTable的下标, -1表示空位置
+struct SlotTable
+{
+    int8_t slots[TableSize];
+};
+static constexpr SlotTable buildSlots()
+{
+    SlotTable table = {};
+    for (uint32_t i = 0; i < TableSize; ++i)
+    {
+        table.slots[i] = -1;
+    }
+    for (int i = 0; i < EntryCount; ++i)
+    {
+        table.slots[slotOf(MimeTable[i].ext, Seed)] = i;
+    }
+    return table;
+}
+static constexpr SlotTable Slots = buildSlots();
+
+// 在内置的表中查找小写的扩展名, 没有时返回空的string_view
+static string_view findBuiltinType(string_view ext)
+{
+    int index = Slots.slots[slotOf(ext, Seed)];
+    if (index >= 0 && MimeTable[index].ext == ext)
+    {
+        return MimeTable[index].type;
+    }
+    return string_view();
+}
+
+unordered_map<string_view, string_view> MimeTypes::m_extraTypes;
+deque<string> MimeTypes::m_extraStrings;
+
+string_view MimeTypes::lookup(string_view fileName)
+{
+    // a.jpg a.mp4 a.html, 只看最后一级的文件名
+    size_t dot = fileName.rfind('.');
+    if (dot == string_view::npos || fileName.find('/', dot) != string_view::npos)
+    {
+        return DefaultType;
+    }
+    string_view ext = fileName.substr(dot + 1);
+    if (ext.empty() || ext.size() > MaxExtLength)
+    {
+        return DefaultType;
+    }
+    // 转换成小写, 和表中的扩展名比较
+    char lower[MaxExtLength];
+    for (size_t i = 0; i < ext.size(); ++i)
+    {
+        char c = ext[i];
+        lower[i] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+    ext = string_view(lower, ext.size());
+    if (!m_extraTypes.empty())
+    {
+        auto it = m_extraTypes.find(ext);
+        if (it != m_extraTypes.end())
+        {
+            return it->second;
+        }
+    }
+    string_view type = findBuiltinType(ext);
+    return type.empty() ? DefaultType : type;
+}
+
+void MimeTypes::addType(string_view ext, string_view type)
+{
+    if (ext.empty() || ext.size() > MaxExtLength || type.empty())
+    {
+        return;
+    }
+    string key(ext);
+    for (char& c : key)
+    {
+        c = tolower(static_cast<unsigned char>(c));
+    }
+    // mime.types中的类型没有参数, 和内置的类型相同时保留内置的类型, 不丢掉 "; charset=utf-8"
+    string_view builtin = findBuiltinType(key);
+    if (!builtin.empty() && type.find(';') == string_view::npos &&
+        builtin.substr(0, builtin.find(';')) == type)
+    {
+        m_extraTypes.erase(key);
+        return;
+    }
+    m_extraStrings.emplace_back(type);
+    string_view value = m_extraStrings.back();
+    auto it = m_extraTypes.find(key);
+    if (it != m_extraTypes.end())
+    {
+        // 覆盖之前添加的类型, 旧的字符串只在启动时产生, 不再释放
+        it->second = value;
+        return;
+    }
+    m_extraStrings.push_back(move(key));
+    m_extraTypes.emplace(m_extraStrings.back(), value);
+}
+
+bool MimeTypes::loadFile(const char* path)
+{
+    ifstream file(path);
+    if (!file)
+    {
+        perror("open mime types");
+        return false;
+    }
+    string line;
+    while (getline(file, line))
+    {
+        size_t comment = line.find('#');
+        if (comment != string::npos)
+        {
+            line.resize(comment);
+        }
+        // 第一列是类型, 后面都是扩展名
+        istringstream fields(line);
+        string type, ext;
+        if (!(fields >> type))
+        {
+            continue;
+        }
+        while (fields >> ext)
+        {
+            addType(ext, type);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <deque>
+using namespace std;
+
+// 文件扩展名 -> MIME类型
+// 内置的对应关系在编译期生成一个完美哈希表, 查找时只需要计算一次哈希和比较一次字符串
+// 返回的string_view指向静态的存储, 一直有效, 不需要申请内存
+class MimeTypes
+{
+public:
+    // 扩展名的最大长度, 更长的扩展名一定不在表中
+    static const int MaxExtLength = 16;
+
+    // 根据文件名查找MIME类型, 不区分扩展名的大小写, 未知的类型按纯文本处理
+    static string_view lookup(string_view fileName);
+    // 添加或者覆盖一个扩展名(不带'.')的类型, 只能在服务器启动之前调用
+    // 和内置的类型相同但是没有参数时(如"text/html")不覆盖, 保留内置类型中的charset
+    static void addType(string_view ext, string_view type);
+    // 从mime.types格式的文件("类型 扩展名1 扩展名2 ...", #开头是注释)中加载额外的类型
+    static bool loadFile(const char* path);
+
+private:
+    // 启动时添加的类型, 优先于内置的类型, 启动之后只读
+    // key是string_view, 查找时直接使用栈上转换成小写的扩展名, 不需要构造string
+    static unordered_map<string_view, string_view> m_extraTypes;
+    // m_extraTypes中的扩展名和类型的存储, deque在末尾添加元素时已有的元素不会移动
+    static deque<string> m_extraStrings;
+};
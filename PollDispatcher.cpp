@@ -2,6 +2,7 @@
 #include <poll.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 #include "PollDispatcher.h"
 
 PollDispatcher::PollDispatcher(EventLoop* evloop) : Dispatcher(evloop)
@@ -64,8 +65,11 @@ int PollDispatcher::remove()
             break;
         }
     }
-    // 通过 channel 释放对应的 TcpConnection 资源
-    m_channel->destroyCallback(const_cast<void*>(m_channel->getArg()));
+    // 通过 channel 释放对应的 TcpConnection 资源, 没有destroyCallback的channel由EventLoop释放
+    if (m_channel->destroyCallback)
+    {
+        m_channel->destroyCallback(const_cast<void*>(m_channel->getArg()));
+    }
     if (i >= m_maxNode)
     {
         return -1;
@@ -102,9 +106,13 @@ int PollDispatcher::modify()
 
 int PollDispatcher::dispatch(int timeout)
 {
-    int count = poll(m_fds, m_maxfd + 1, timeout * 1000);
+    int count = poll(m_fds, m_maxfd + 1, timeout);
     if (count == -1)
     {
+        if (errno == EINTR)
+        {
+            return 0;
+        }
         perror("poll");
         exit(0);
     }
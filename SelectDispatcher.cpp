@@ -1,6 +1,7 @@
 #include "Dispatcher.h"
 #include <sys/select.h>
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include "SelectDispatcher.h"
 
@@ -35,24 +36,33 @@ int SelectDispatcher::add()
 int SelectDispatcher::remove()
 {
     clearFdSet();
-    // 通过 channel 释放对应的 TcpConnection 资源
-    m_channel->destroyCallback(const_cast<void*>(m_channel->getArg()));
+    // 通过 channel 释放对应的 TcpConnection 资源, 没有destroyCallback的channel由EventLoop释放
+    if (m_channel->destroyCallback)
+    {
+        m_channel->destroyCallback(const_cast<void*>(m_channel->getArg()));
+    }
 
     return 0;
 }
 
 int SelectDispatcher::modify()
 {
+    if (m_channel->getSocket() >= m_maxSize)
+    {
+        return -1;
+    }
+    // 先把fd从两个集合中都删除, 再根据channel当前的事件重新注册
+    FD_CLR(m_channel->getSocket(), &m_readSet);
+    FD_CLR(m_channel->getSocket(), &m_writeSet);
     setFdSet();
-    clearFdSet();
     return 0;
 }
 
-int SelectDispatcher::dispatch(int timeout) // timeout默认2s（默认参数的声明在父类头文件中）
+int SelectDispatcher::dispatch(int timeout) // timeout的单位是ms, 默认一直等待（默认参数的声明在父类头文件中）
 {
     struct timeval val;
-    val.tv_sec = timeout;
-    val.tv_usec = 0;
+    val.tv_sec = timeout / 1000;
+    val.tv_usec = (timeout % 1000) * 1000;
     fd_set rdtmp = m_readSet; // 每次调用都要重置
     fd_set wrtmp = m_writeSet; // 每次调用都要重置
     // 调用select监测发生的事件，返回事件的数目（select是阻塞函数）
@@ -60,9 +70,13 @@ int SelectDispatcher::dispatch(int timeout) // timeout默认2s（默认参数的
     // 将发生待读取事件的文件描述符放入rdtmp中
     // 将发生可写入事件的文件描述符放入wrtmp中
     // select超时时返回0，发生错误时返回-1，正常情况下返回发生事件的文件描述符的数量
-    int count = select(m_maxSize, &rdtmp, &wrtmp, NULL, &val);
+    int count = select(m_maxSize, &rdtmp, &wrtmp, NULL, timeout < 0 ? NULL : &val);
     if (count == -1)
     {
+        if (errno == EINTR)
+        {
+            return 0;
+        }
         perror("select");
         exit(0);
     }
@@ -101,6 +115,11 @@ void SelectDispatcher::setFdSet()
 
 void SelectDispatcher::clearFdSet()
 {
+    // 超出fd_set范围的fd不可能注册过, FD_CLR会越界写内存
+    if (m_channel->getSocket() >= m_maxSize)
+    {
+        return;
+    }
     if (m_channel->getEvent() & (int)FDEvent::ReadEvent)
     {
         FD_CLR(m_channel->getSocket(), &m_readSet);
@@ -18,7 +18,7 @@ public:
     // 修改
     int modify() override;
     // 事件监测
-    int dispatch(int timeout = 2) override; // 单位: s
+    int dispatch(int timeout = -1) override; // 单位: ms, -1表示一直等待
 
 private:
     void setFdSet();
@@ -0,0 +1,61 @@
+#pragma once
+#include <stddef.h>
+#include <utility>
+#include <vector>
+using namespace std;
+
+// 前N个元素保存在对象内部的数组中, 超出之后才使用堆内存的vector
+// 对象嵌在连接中, 和连接一起从内存池中分配, 一般的请求不会为它申请内存
+// 只提供解析器和响应需要的操作, 元素需要可以默认构造
+template <typename T, size_t N>
+class SmallVector
+{
+public:
+    inline void push_back(T value)
+    {
+        if (m_size < N)
+        {
+            m_inline[m_size] = move(value);
+        }
+        else
+        {
+            m_overflow.push_back(move(value));
+        }
+        ++m_size;
+    }
+    inline T& operator[](size_t index)
+    {
+        return index < N ? m_inline[index] : m_overflow[index - N];
+    }
+    inline const T& operator[](size_t index) const
+    {
+        return index < N ? m_inline[index] : m_overflow[index - N];
+    }
+    inline T& front()
+    {
+        return m_inline[0];
+    }
+    inline size_t size() const
+    {
+        return m_size;
+    }
+    inline bool empty() const
+    {
+        return m_size == 0;
+    }
+    // 内部数组中的元素重置为默认值(释放元素持有的资源), 溢出部分的内存不释放, 之后继续使用
+    inline void clear()
+    {
+        for (size_t i = 0; i < m_size && i < N; ++i)
+        {
+            m_inline[i] = T();
+        }
+        m_overflow.clear();
+        m_size = 0;
+    }
+
+private:
+    T m_inline[N];
+    vector<T> m_overflow;
+    size_t m_size = 0;
+};
@@ -2,110 +2,343 @@
 #include "HttpRequest.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <new>
 #include "Log.h"
 
+// 一个连接占用的内存: 连接对象 + 读缓冲区 + 写缓冲区
+static const size_t ConnectionRecordSize = sizeof(TcpConnection) + 2 * TcpConnection::BufferSize;
+
+int TcpConnection::m_headerTimeout = 15 * 1000;
+int TcpConnection::m_bodyTimeout = 30 * 1000;
+int TcpConnection::m_keepAliveTimeout = 60 * 1000;
+
+void TcpConnection::setTimeouts(int headerMs, int bodyMs, int keepAliveMs)
+{
+    m_headerTimeout = headerMs;
+    m_bodyTimeout = bodyMs;
+    m_keepAliveTimeout = keepAliveMs;
+}
+
 int TcpConnection::processRead(void* arg)
 {
     // 传入的arg参数是个TcpConnection对象的this指针，将arg从void*转换成TcpConnection类型
     TcpConnection* conn = static_cast<TcpConnection*>(arg);
     // 接收数据
-    int socket = conn->m_channel->getSocket();
-    int count = conn->m_readBuf->socketRead(socket);
-
-    Debug("接收到的http请求数据: %s", conn->m_readBuf->data());
-    if (count > 0)
-    {
-        // 接收到了 http 请求, 解析http请求
-#ifdef MSG_SEND_AUTO
-        conn->m_channel->writeEventEnable(true);
-        conn->m_evLoop->addTask(conn->m_channel, ElemType::MODIFY);
-#endif
-        bool flag = conn->m_request->parseHttpRequest(
-            conn->m_readBuf, conn->m_response,
-            conn->m_writeBuf, socket);
-        if (!flag)
+    int socket = conn->m_channel.getSocket();
+    int total = 0;
+    if (conn->m_evLoop->isCompletionBased())
+    {
+        // 数据已经由反应堆接收到读缓冲区中, 结果为0表示对方断开了连接
+        total = conn->m_channel.getResult();
+        if (total <= 0)
         {
-            // 解析失败, 回复一个简单的html
-            string errMsg = "Http/1.1 400 Bad Request\r\n\r\n";
-            conn->m_writeBuf->appendString(errMsg);
+            total = 0;
+            conn->m_peerClosed = true;
         }
     }
     else
     {
-#ifdef MSG_SEND_AUTO
-        // 断开连接
-        conn->m_evLoop->addTask(conn->m_channel, ElemType::DELETE);
-#endif
+        while (true)
+        {
+            int count = conn->m_readBuf.socketRead(socket);
+            if (count > 0)
+            {
+                total += count;
+                // 边沿触发模式下同一批数据只通知一次, 需要一直读到EAGAIN为止
+                // 读够了上限还没有读完时交给反应堆在下一轮循环中再读, 先处理其他连接的事件
+                if (conn->m_evLoop->isEdgeTriggered())
+                {
+                    if (total < MaxReadPerEvent)
+                    {
+                        continue;
+                    }
+                    conn->m_evLoop->activateLater(socket, (int)FDEvent::ReadEvent);
+                }
+                break;
+            }
+            // 返回0表示对方断开了连接, 返回-1并且不是EAGAIN表示出错了
+            if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                conn->m_peerClosed = true;
+            }
+            break;
+        }
+    }
 
+    // 缓冲区中的数据不是以'\0'结尾的, 需要指定长度
+    Debug("接收到的http请求数据: %.*s", conn->m_readBuf.readableSize(), conn->m_readBuf.data());
+    if (total == 0 && !conn->m_peerClosed)
+    {
+        return 0;
+    }
+    // 解析并处理缓冲区中的请求, 发送响应, 返回false表示需要断开连接
+    if (!conn->processRequests())
+    {
+        // 断开连接
+        conn->m_evLoop->addTask(&conn->m_channel, ElemType::DELETE);
     }
-#ifndef MSG_SEND_AUTO
-    // 断开连接
-    conn->m_evLoop->addTask(conn->m_channel, ElemType::DELETE);
-#endif
     return 0;
 }
 
+int TcpConnection::flushOutput()
+{
+    // 写缓冲区中的数据(响应行、响应头)和响应体的各个片段按顺序发送, 尽量合并成一次系统调用
+    if (!m_evLoop->isCompletionBased())
+    {
+        return m_response.sendData(m_channel.getSocket(), &m_writeBuf);
+    }
+    // 完成模式: 内存中的数据交给反应堆提交sendmsg请求, 完成之后在写回调中继续; 文件片段仍然使用sendfile
+    if (m_sendInFlight)
+    {
+        return 0;
+    }
+    while (true)
+    {
+        struct msghdr* msg = m_response.prepareSendMsg(&m_writeBuf);
+        if (msg != nullptr)
+        {
+            if (m_evLoop->sendMsg(&m_channel, msg) == -1)
+            {
+                return -1;
+            }
+            m_sendInFlight = true;
+            return 0;
+        }
+        if (!m_response.hasPendingSegments())
+        {
+            return 1;
+        }
+        int ret = m_response.sendFileData(m_channel.getSocket());
+        if (ret != 1)
+        {
+            return ret;
+        }
+    }
+}
+
+void TcpConnection::updateEvents(bool readable, bool writable)
+{
+    if (m_channel.isReadEventEnable() == readable && m_channel.isWriteEventEnable() == writable)
+    {
+        return;
+    }
+    m_channel.readEventEnable(readable);
+    m_channel.writeEventEnable(writable);
+    m_evLoop->addTask(&m_channel, ElemType::MODIFY);
+}
+
+bool TcpConnection::processRequests()
+{
+    while (true)
+    {
+        // 先尝试直接发送, 上一个响应没有发送完时不解析后续的请求, 保证响应的顺序
+        int ret = flushOutput();
+        if (ret == -1)
+        {
+            return false;
+        }
+        if (ret == 0)
+        {
+            // 剩下的数据等socket可写之后继续发送, 客户端接收得太慢时暂停读取它的数据
+            long pending = m_writeBuf.readableSize() + m_response.getPendingSize();
+            reportPending(pending);
+            bool readable = m_channel.isReadEventEnable();
+            if (pending >= HighWaterMark)
+            {
+                readable = false;
+            }
+            else if (pending < LowWaterMark)
+            {
+                readable = true;
+            }
+            updateEvents(readable && !m_peerClosed, true);
+            // 客户端一直不接收数据时也需要断开连接
+            updateTimer(TimeoutType::Body);
+            return true;
+        }
+        // 响应全部发送完了, 关闭打开的文件, 不再检测写事件, 准备处理下一个请求
+        m_response.reset();
+        reportPending(0);
+        updateEvents(!m_peerClosed, false);
+        if (m_closeAfterWrite)
+        {
+            return false;
+        }
+        // 客户端可能连续发送多个请求(pipelining), 按顺序依次处理
+        if (m_readBuf.readableSize() == 0)
+        {
+            // 服务器正在停止, 不再等待下一个请求
+            if (m_evLoop->isDraining() && m_request.getState() == PrecessState::ParseReqLine)
+            {
+                return false;
+            }
+            // 等待请求体中剩下的数据, 或者下一个请求
+            updateTimer(m_request.getState() == PrecessState::ParseReqBody ? TimeoutType::Body : TimeoutType::KeepAlive);
+            return !m_peerClosed;
+        }
+        bool flag = m_request.parseHttpRequest(&m_readBuf, &m_response, &m_writeBuf);
+        if (!flag)
+        {
+            // 解析失败, 回复一个简单的html, 之后无法再确定请求的边界, 需要断开连接
+            // 静态字符串直接作为响应的片段发送, 不需要拷贝
+            static const char errMsg[] = "HTTP/1.1 400 Bad Request\r\nContent-length: 0\r\nConnection: close\r\n\r\n";
+            m_response.addMemorySegment(errMsg, sizeof(errMsg) - 1);
+            m_closeAfterWrite = true;
+            continue;
+        }
+        if (m_request.getState() != PrecessState::ParseReqDone)
+        {
+            // 请求头处理完之后已经生成了响应, 可以在接收请求体的同时先发送
+            if (m_writeBuf.readableSize() > 0 || m_response.hasPendingSegments())
+            {
+                continue;
+            }
+            // 请求还不完整, 等待后续的数据
+            updateTimer(m_request.getState() == PrecessState::ParseReqBody ? TimeoutType::Body : TimeoutType::Header);
+            return !m_peerClosed;
+        }
+        // 一个请求处理完了, 重置之后继续用于下一个请求, 响应在发送完之后重置
+        // 服务器正在停止时发送完这个响应就断开连接
+        m_closeAfterWrite = !m_request.isKeepAlive() || m_evLoop->isDraining();
+        m_request.reset();
+        // 下一个请求的请求头重新计时
+        m_timeoutType = TimeoutType::KeepAlive;
+    }
+}
+
 int TcpConnection::processWrite(void* arg)
 {
     Debug("开始发送数据了(基于写事件发送)....");
     TcpConnection* conn = static_cast<TcpConnection*>(arg);
-    // 发送数据
-    int count = conn->m_writeBuf->sendData(conn->m_channel->getSocket());
-    if (count > 0)
+    // 完成模式下的写事件是sendmsg请求完成了, 扣除已经发送的数据
+    if (conn->m_sendInFlight)
     {
-        // 判断数据是否被全部发送出去了
-        if (conn->m_writeBuf->readableSize() == 0)
+        conn->m_sendInFlight = false;
+        int result = conn->m_channel.getResult();
+        if (result < 0)
         {
-            // 1. 不再检测写事件 -- 修改channel中保存的事件
-            conn->m_channel->writeEventEnable(false);
-            // 2. 修改dispatcher检测的集合 -- 添加任务节点
-            conn->m_evLoop->addTask(conn->m_channel, ElemType::MODIFY);
-            // 3. 删除这个节点
-            conn->m_evLoop->addTask(conn->m_channel, ElemType::DELETE);
+            conn->m_evLoop->addTask(&conn->m_channel, ElemType::DELETE);
+            return 0;
         }
+        conn->m_response.consumeSent(&conn->m_writeBuf, result);
+    }
+    // 继续发送没有发送完的响应, 发送完之后会接着处理已经接收到的请求
+    if (!conn->processRequests())
+    {
+        conn->m_evLoop->addTask(&conn->m_channel, ElemType::DELETE);
     }
     return 0;
 }
 
+void TcpConnection::updateTimer(TimeoutType type)
+{
+    // 请求头的超时从第一个字节开始计算, 收到一部分数据不延长, 防止请求头被一点点地发送过来一直占用连接
+    if (type == TimeoutType::Header && m_timeoutType == TimeoutType::Header && m_timer.isActive())
+    {
+        return;
+    }
+    m_timeoutType = type;
+    int timeout = m_bodyTimeout;
+    if (type == TimeoutType::Header)
+    {
+        timeout = m_headerTimeout;
+    }
+    else if (type == TimeoutType::KeepAlive)
+    {
+        timeout = m_keepAliveTimeout;
+    }
+    m_evLoop->addTimer(&m_timer, timeout);
+}
+
+int TcpConnection::processTimeout(void* arg)
+{
+    TcpConnection* conn = static_cast<TcpConnection*>(arg);
+    // 服务器停止时所有连接的定时器都会被触发: 还有数据没有发送完或者请求还没有接收完的连接继续处理, 不断开
+    if (conn->m_evLoop->getDrainState() == DrainState::Draining && conn->isBusy())
+    {
+        conn->updateTimer(conn->m_timeoutType);
+        return 0;
+    }
+    Debug("连接超时, 断开连接, fd: %d", conn->m_channel.getSocket());
+    conn->m_evLoop->addTask(&conn->m_channel, ElemType::DELETE);
+    return 0;
+}
+
 int TcpConnection::destroy(void* arg)
 {
     TcpConnection* conn = static_cast<TcpConnection*>(arg);
     if (conn != nullptr)
     {
-        delete conn;
+        // 对象是在内存池的内存块上构造的, 析构之后把内存块还给内存池
+        EventLoop* evLoop = conn->m_evLoop;
+        conn->~TcpConnection();
+        evLoop->getConnectionPool(ConnectionRecordSize)->deallocate(conn);
     }
     return 0;
 }
 
+void TcpConnection::reportPending(long pending)
+{
+    if (pending != m_pendingReported)
+    {
+        m_evLoop->updatePendingBytes(pending - m_pendingReported);
+        m_pendingReported = pending;
+    }
+}
+
+bool TcpConnection::isBusy()
+{
+    return m_writeBuf.readableSize() > 0 || m_response.hasPendingSegments() ||
+        m_readBuf.readableSize() > 0 || m_request.getState() != PrecessState::ParseReqLine;
+}
+
+TcpConnection* TcpConnection::create(int fd, EventLoop* evloop)
+{
+    void* record = evloop->getConnectionPool(ConnectionRecordSize)->allocate();
+    if (record == nullptr)
+    {
+        close(fd);
+        return nullptr;
+    }
+    char* storage = static_cast<char*>(record) + sizeof(TcpConnection);
+    return new (record) TcpConnection(fd, evloop, storage);
+}
+
 // 在TcpServer::acceptConnection中被调用
 // fd是连接客户端socket的文件描述符
 // evloop是从ThreadPool::m_workerThreads线程池vector中取出的子线程的反应堆;
 // m_workerThreads[m_index]->getEventLoop();
-TcpConnection::TcpConnection(int fd, EventLoop* evloop)
+TcpConnection::TcpConnection(int fd, EventLoop* evloop, char* storage) :
+    m_channel(fd, FDEvent::ReadEvent, processRead, processWrite, destroy, this),
+    m_readBuf(storage, BufferSize),
+    m_writeBuf(storage + BufferSize, BufferSize),
+    m_timer(processTimeout, this)
 {
     m_evLoop = evloop;
-    m_readBuf = new Buffer(10240);
-    m_writeBuf = new Buffer(10240);
-    // http
-    m_request = new HttpRequest;
-    m_response = new HttpResponse;
-    m_name = "Connection-" + to_string(fd);
-    m_channel = new Channel(fd, FDEvent::ReadEvent, processRead, processWrite, destroy, this);
+    m_closeAfterWrite = false;
+    m_peerClosed = false;
+    m_sendInFlight = false;
+    // 完成模式下反应堆把数据直接接收到读缓冲区中
+    m_channel.setReadBuffer(&m_readBuf);
+    // 新连接需要在请求头的超时时长内发送一个完整的请求头
+    m_timeoutType = TimeoutType::Header;
+    m_pendingReported = 0;
+    // 在主线程中创建时也立即计入负载, 连续建立的连接才能分散到不同的反应堆
+    evloop->updateConnectionCount(1);
+    evloop->addTimer(&m_timer, m_headerTimeout);
     // 调用子线程的从反应堆的addTask()方法，将m_channel添加到从反应堆的任务队列m_taskQ中
     // 后续子线程会依次对m_taskQ中的任务进行监听，并做相应处理
-    evloop->addTask(m_channel, ElemType::ADD);
+    evloop->addTask(&m_channel, ElemType::ADD);
 }
 
 TcpConnection::~TcpConnection()
 {
-    if (m_readBuf && m_readBuf->readableSize() == 0 &&
-        m_writeBuf && m_writeBuf->readableSize() == 0)
-    {
-        delete m_readBuf;
-        delete m_writeBuf;
-        delete m_request;
-        delete m_response;
-        m_evLoop->freeChannel(m_channel);
-    }
-    Debug("连接断开, 释放资源, gameover, connName: %s", m_name.data());
+    // 长连接在断开时缓冲区中可能还有没处理完的数据, 成员对象析构时一起释放
+    m_evLoop->removeTimer(&m_timer);
+    m_evLoop->freeChannel(&m_channel);
+    m_evLoop->updatePendingBytes(-m_pendingReported);
+    m_evLoop->updateConnectionCount(-1);
+    Debug("连接断开, 释放资源, gameover, fd: %d", m_channel.getSocket());
 }
@@ -5,24 +5,73 @@
 #include "HttpRequest.h"
 #include "HttpResponse.h"
 
-//#define MSG_SEND_AUTO
+// 使用sendfile零拷贝发送文件, 注释掉之后使用read + send的方式
+#define SEND_FILE_ZERO_COPY
 
 class TcpConnection
 {
 public:
-    TcpConnection(int fd, EventLoop* evloop);
-    ~TcpConnection();
+    // 待发送的数据超过高水位时暂停读取客户端的数据, 降到低水位以下时恢复
+    static const int HighWaterMark = 64 * 1024;
+    static const int LowWaterMark = 16 * 1024;
+    // 边沿触发模式下每次读事件最多读取的字节数, 剩下的数据在下一轮循环中继续读, 其他连接不会被一个连接饿死
+    static const int MaxReadPerEvent = 64 * 1024;
+    // 读写缓冲区的初始大小, 缓冲区的内存和连接对象放在同一个内存块中
+    static const int BufferSize = 10240;
+
+    // 从evloop的内存池中取出一个内存块创建连接, 连接断开时由destroy()放回内存池
+    static TcpConnection* create(int fd, EventLoop* evloop);
+    // 设置超时时长(ms), 需要在服务器启动之前调用
+    // header: 从收到请求的第一个字节(新连接从建立时)开始, 接收完整个请求头的时长, 收到数据不会延长
+    // body: 接收请求体或者发送响应时, 两次读写之间的最长间隔
+    // keepAlive: 处理完一个请求之后等待下一个请求的时长
+    static void setTimeouts(int headerMs, int bodyMs, int keepAliveMs);
 
     static int processRead(void* arg);
     static int processWrite(void* arg);
+    static int processTimeout(void* arg);
     static int destroy(void* arg);
 private:
-    string m_name;
+    // 连接当前使用的超时类型
+    enum class TimeoutType:char
+    {
+        Header,
+        Body,
+        KeepAlive
+    };
+
+    // storage指向紧跟在对象后面的两个缓冲区的内存
+    TcpConnection(int fd, EventLoop* evloop, char* storage);
+    ~TcpConnection();
+    // 发送上一个响应, 然后依次处理读缓冲区中完整的请求, 需要断开连接时返回false
+    bool processRequests();
+    // 发送写缓冲区和响应体中待发送的数据, 返回值: 1 发送完毕, 0 socket暂时不可写, -1 出错
+    int flushOutput();
+    // 根据需要修改检测的读写事件, 有变化时才通知dispatcher
+    void updateEvents(bool readable, bool writable);
+    // 按连接当前的状态重新设置定时器, 接收请求头期间不重新计时
+    void updateTimer(TimeoutType type);
+    // 是否有正在处理的请求: 响应还没有发送完, 或者已经收到了下一个请求的一部分
+    bool isBusy();
+    // 把待发送的字节数的变化累加到反应堆的负载信息中
+    void reportPending(long pending);
+
+private:
     EventLoop* m_evLoop;
-    Channel* m_channel;
-    Buffer* m_readBuf;
-    Buffer* m_writeBuf;
+    Channel m_channel;
+    Buffer m_readBuf;
+    Buffer m_writeBuf;
     // http 协议
-    HttpRequest* m_request;
-    HttpResponse* m_response;
+    HttpRequest m_request;
+    HttpResponse m_response;
+    bool m_closeAfterWrite; // 数据发送完之后断开连接
+    bool m_peerClosed; // 对方已经关闭了连接(或者读出错了)
+    bool m_sendInFlight; // 完成模式下提交的sendmsg请求还没有完成
+    Timer m_timer;  // 超时之后断开连接, 由反应堆的时间轮管理
+    TimeoutType m_timeoutType;
+    long m_pendingReported; // 已经计入反应堆负载的待发送字节数
+
+    static int m_headerTimeout;
+    static int m_bodyTimeout;
+    static int m_keepAliveTimeout;
 };
\ No newline at end of file
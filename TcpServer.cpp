@@ -1,15 +1,22 @@
 #include "TcpServer.h"
 #include <arpa/inet.h>
 #include "TcpConnection.h"
+#include "FileCache.h"
+#include "CompressionCache.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
 #include "Log.h"
 
 // TcpServer构造函数
-TcpServer::TcpServer(unsigned short port, int threadNum)
+TcpServer::TcpServer(unsigned short port, int threadNum, DispatcherType type)
 {
     m_port = port;
-    m_mainLoop = new EventLoop; // 实例化EventLoop，主反应堆，它的m_taskQ中存放着任务队列
+    m_mainLoop = new EventLoop(string(), type); // 实例化EventLoop，主反应堆，它的m_taskQ中存放着任务队列
     // EventLoop类，即Reactor，负责对事件进行反应，即监听和分发事件，事件类型包含连接事件、读写事件等
     // EventLoop类中声明了一个select方法（实际是封装了select方法的SelectDispatcher类对象）；
 
@@ -17,99 +24,319 @@ TcpServer::TcpServer(unsigned short port, int threadNum)
     m_threadPool = new ThreadPool(m_mainLoop, threadNum); // 实例化线程池，传入的是主反应堆对象的指针
     // 线程池中new了threadNum个子线程对象，它们的指针保存在一个vector中；每个子线程又包含一个(从)反应堆对象
 
-    setListen(); // 调用setListen()
+    // 监听fd在run()中创建, 因为SO_REUSEPORT模式下主反应堆不需要监听
 }
 
-void TcpServer::setListen()
+TcpServer::~TcpServer()
+{
+    // 先等待子线程退出, 再释放主反应堆
+    delete m_threadPool;
+    delete m_mainLoop;
+}
+
+void TcpServer::setCpuAffinity(const vector<int>& cpus)
+{
+    m_cpus = cpus;
+    vector<int> workerCpus;
+    for (int i = 0; !cpus.empty() && i < m_threadNum; ++i)
+    {
+        workerCpus.push_back(cpus[(i + 1) % cpus.size()]);
+    }
+    m_threadPool->setWorkerCpus(workerCpus);
+}
+
+void TcpServer::setTimeouts(int headerMs, int bodyMs, int keepAliveMs)
+{
+    TcpConnection::setTimeouts(headerMs, bodyMs, keepAliveMs);
+}
+
+int TcpServer::createListenFd(bool reusePort, int incomingCpu)
 {
     // 1. 创建监听的fd
-    m_lfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (m_lfd == -1)
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd == -1)
     {
         perror("socket");
-        return;
+        return -1;
     }
     // 2. 设置端口复用
     int opt = 1;
-    int ret = setsockopt(m_lfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+    int ret = setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
     if (ret == -1)
     {
         perror("setsockopt");
-        return;
+        return -1;
+    }
+    // 多个socket绑定同一个端口, 由内核在它们之间分配新连接
+    if (reusePort)
+    {
+        ret = setsockopt(lfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof opt);
+        if (ret == -1)
+        {
+            perror("setsockopt SO_REUSEPORT");
+            return -1;
+        }
+    }
+    // 同一组SO_REUSEPORT的socket中, 内核优先把连接交给SO_INCOMING_CPU等于处理数据包的cpu的socket
+    if (incomingCpu >= 0)
+    {
+        ret = setsockopt(lfd, SOL_SOCKET, SO_INCOMING_CPU, &incomingCpu, sizeof incomingCpu);
+        if (ret == -1)
+        {
+            perror("setsockopt SO_INCOMING_CPU");
+        }
     }
     // 3. 绑定
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_port = htons(m_port);
     addr.sin_addr.s_addr = INADDR_ANY;
-    ret = bind(m_lfd, (struct sockaddr*)&addr, sizeof addr);
+    ret = bind(lfd, (struct sockaddr*)&addr, sizeof addr);
     if (ret == -1)
     {
         perror("bind");
-        return ;
+        return -1;
     }
-    // 4. 设置监听
-    ret = listen(m_lfd, 128);
+    // 4. 设置为非阻塞, acceptConnection中会一直accept到EAGAIN为止（边沿触发模式下必须这样做）
+    fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+    // 5. 设置监听
+    ret = listen(lfd, 128);
     if (ret == -1)
     {
         perror("listen");
-        return ;
+        return -1;
     }
-    // 5. 输出监听端口的ip:port
+    // 6. 输出监听端口的ip:port
     struct sockaddr_in listenAddr;
     socklen_t listenAddrLen = sizeof(listenAddr);
-    ret = getsockname(m_lfd, (struct sockaddr *)&listenAddr, &listenAddrLen);
+    ret = getsockname(lfd, (struct sockaddr *)&listenAddr, &listenAddrLen);
     if(ret == -1)
     {
         printf("getsockname error\n");
         exit(0);
     }
     printf("listening address = %s:%d\n", inet_ntoa(listenAddr.sin_addr), ntohs(listenAddr.sin_port));
+    return lfd;
+}
+
+void TcpServer::setListen()
+{
+    m_lfd = createListenFd(false);
+}
 
+void TcpServer::setReusePortListen()
+{
+    // 没有子线程时由主反应堆自己处理连接
+    int count = m_threadPool->getThreadNum();
+    int loopNum = count > 0 ? count : 1;
+    for (int i = 0; i < loopNum; ++i)
+    {
+        EventLoop* evLoop = count > 0 ? m_threadPool->getWorkerEventLoop(i) : m_mainLoop;
+        int cpu = -1;
+        if (m_incomingCpu)
+        {
+            cpu = count > 0 ? m_threadPool->getWorkerCpu(i) : (m_cpus.empty() ? -1 : m_cpus[0]);
+        }
+        int lfd = createListenFd(true, cpu);
+        if (lfd == -1)
+        {
+            exit(0);
+        }
+        // 监听fd的channel添加到这个从反应堆中, 连接在从反应堆的线程中被accept, 不再经过主反应堆转交
+        auto obj = bind(&TcpServer::acceptOnLoop, lfd, evLoop);
+        Channel* channel = new Channel(lfd, FDEvent::ReadEvent, obj, nullptr, nullptr, evLoop);
+        channel->setAcceptor(true);
+        evLoop->addTask(channel, ElemType::ADD);
+        m_listeners.push_back(make_pair(evLoop, channel));
+    }
+}
+
+int TcpServer::acceptFd(int lfd, EventLoop* evLoop)
+{
+    while (true)
+    {
+        int cfd = -1;
+        if (evLoop->isCompletionBased())
+        {
+            // 完成模式下反应堆已经accept了一个连接, 取出之后把结果改为EAGAIN, 下一次调用返回-1
+            Channel* channel = evLoop->findChannel(lfd);
+            cfd = channel->getResult();
+            channel->setResult(-EAGAIN);
+            if (cfd < 0)
+            {
+                errno = -cfd;
+                cfd = -1;
+            }
+        }
+        else
+        {
+            // 和客户端建立连接, 通信的fd设置为非阻塞, 数据发送不完时由写事件继续发送
+            cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+        }
+        if (cfd == -1)
+        {
+            if ((errno == EINTR || errno == ECONNABORTED) && !evLoop->isCompletionBased())
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("accept");
+            }
+            return -1;
+        }
+
+        // 输出客户端的ip:port
+        struct sockaddr_in connectedAddr;
+        socklen_t connectedAddrLen = sizeof(connectedAddr);
+        int ret = getsockname(cfd, (struct sockaddr *)&connectedAddr, &connectedAddrLen);
+        if(ret == -1)
+        {
+            printf("getsockname error\n");
+            exit(0);
+        }
+        printf("connected address = %s:%d\n", inet_ntoa(connectedAddr.sin_addr), ntohs(connectedAddr.sin_port));
+        return cfd;
+    }
 }
 
 int TcpServer::acceptConnection(void* arg)
 {
     TcpServer* server = static_cast<TcpServer*>(arg); // 将void*类型转换成TcpServer*类型
-    // 和客户端建立连接
-    int cfd = accept(server->m_lfd, NULL, NULL);
+    // m_lfd是非阻塞的, 一次把已完成握手的连接全部取出来
+    int cfd = -1;
+    while ((cfd = acceptFd(server->m_lfd, server->m_mainLoop)) != -1)
+    {
+        // 处理这个连接的数据包的cpu, 优先交给绑定在这个cpu上的子线程
+        int cpu = -1;
+        if (server->m_incomingCpu)
+        {
+            socklen_t len = sizeof(cpu);
+            if (getsockopt(cfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1)
+            {
+                cpu = -1;
+            }
+        }
+        // 从线程池中取出一个子线程的从反应堆实例, 去处理这个cfd（按负载选择反应堆）
+        EventLoop* evLoop = server->m_threadPool->takeWorkerEventLoop(cpu);
+        // 将cfd放到 TcpConnection中处理，传入反应堆对象的指针evLoop
+        /*这里将连接的客户端的socket的fd，以及一个子线程的从反应堆指针，封装成一个TcpConnection
+        之后在TcpConnection中又会将任务重新封装成一个channel，添加到子线程从反应堆的任务队列m_taskQ中*/
+        TcpConnection::create(cfd, evLoop);
+    }
+    return 0;
+}
 
-    // 输出客户端的ip:port
-    struct sockaddr_in connectedAddr;
-    socklen_t connectedAddrLen = sizeof(connectedAddr);
-    int ret = getsockname(cfd, (struct sockaddr *)&connectedAddr, &connectedAddrLen);
-    if(ret == -1)
+int TcpServer::acceptOnLoop(int lfd, EventLoop* evLoop)
+{
+    int cfd = -1;
+    while ((cfd = acceptFd(lfd, evLoop)) != -1)
     {
-        printf("getsockname error\n");
+        // 当前就是evLoop的线程, TcpConnection中的addTask会直接处理任务队列
+        TcpConnection::create(cfd, evLoop);
+    }
+    return 0;
+}
+
+void TcpServer::setSignal()
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    // 之后创建的子线程继承屏蔽字, 信号只能通过signalfd读出, 不会打断任何线程
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    m_signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (m_signalFd == -1)
+    {
+        perror("signalfd");
         exit(0);
     }
-    printf("connected address = %s:%d\n", inet_ntoa(connectedAddr.sin_addr), ntohs(connectedAddr.sin_port));
+    Channel* channel = new Channel(m_signalFd, FDEvent::ReadEvent, processSignal, nullptr, nullptr, this);
+    m_mainLoop->addTask(channel, ElemType::ADD);
+}
 
-    // 从线程池中取出一个子线程的从反应堆实例, 去处理这个cfd（按顺序取出反应堆）
-    EventLoop* evLoop = server->m_threadPool->takeWorkerEventLoop();
-    // 将cfd放到 TcpConnection中处理，传入反应堆对象的指针evLoop
-    /*这里将连接的客户端的socket的fd，以及一个子线程的从反应堆指针，封装成一个TcpConnection
-    之后在TcpConnection中又会将任务重新封装成一个channel，添加到子线程从反应堆的任务队列m_taskQ中*/
-    new TcpConnection(cfd, evLoop);
+int TcpServer::processSignal(void* arg)
+{
+    TcpServer* server = static_cast<TcpServer*>(arg);
+    // 边沿触发模式下需要一直读到EAGAIN为止
+    struct signalfd_siginfo info;
+    while (read(server->m_signalFd, &info, sizeof(info)) == sizeof(info))
+    {
+        printf("received signal %d, %s\n", (int)info.ssi_signo,
+            server->m_isStopping ? "closing all connections" : "shutting down...");
+        server->shutdown(server->m_isStopping ? 0 : server->m_shutdownTimeout);
+    }
     return 0;
 }
 
+void TcpServer::shutdown(int timeoutMs)
+{
+    if (!m_isStopping)
+    {
+        m_isStopping = true;
+        // 先停止接收新的连接, 监听fd在它所在的反应堆的线程中删除并关闭
+        for (auto& item : m_listeners)
+        {
+            item.first->addTask(item.second, ElemType::DELETE);
+        }
+        m_listeners.clear();
+    }
+    // 各个反应堆中的连接都断开之后, 反应堆的run()返回
+    m_threadPool->shutdown(timeoutMs);
+    m_mainLoop->shutdown(timeoutMs);
+}
+
 void TcpServer::run()
 {
     Debug("服务器程序已经启动了...");
+    setSignal();
+    // 后台压缩线程继承屏蔽信号之后的信号屏蔽字, 在绑定cpu之前创建, 不和主反应堆抢同一个cpu
+    CompressionCache::getInstance()->start();
+    // 主反应堆已经在构造函数中创建了, 之后创建的连接内存池使用绑定的cpu所在的节点
+    if (!m_cpus.empty())
+    {
+        m_mainLoop->setNumaNode(WorkerThread::bindCpu(m_cpus[0]));
+    }
+    // 监视当前的工作目录(文档根目录), 文件发生变化时由主反应堆删除对应的缓存
+    // 在启动线程池之前调用, 子线程读取inotify的文件描述符时不需要同步
+    FileCache::getInstance()->watch(m_mainLoop, ".");
     // 启动线程池
     m_threadPool->run();
-    // 初始化一个channel实例
-    /*Channel::handleFunc readFunc = accepConnection, Channel::handleFunc writeFunc=nullptr, Channel::handleFunc destroyFunc=nullptr*/
-    // m_lfd是setListen()中创建的监听用的socket的文件描述符，其对应的事件为FDEvent::ReadEvent
-    Channel* channel = new Channel(m_lfd, FDEvent::ReadEvent, acceptConnection, nullptr, nullptr, this);
-
-    // 添加channel到主反应堆的任务队列m_taskQ中
-    // channel中封装了监听用的socket的fd，它对应的事件类型FDEvent::ReadEvent，以及回调函数acceptConnection
-    /* 在反应堆中，反应堆会通过processTask()方法将m_taskQ中的channel取出并注册添加到select的位数组（事件监听表）中，
-     通过SelectDispatcher对象调用select方法对事件进行监听，当监听到事件的发生后，会根据事件的fd找到m_channelMap中对应的channel对象
-     根据channel对象中的events（事件类型）来选择调用处理函数，如果事件类型是ReadEvent则调用readFunc（这里添加的channel就是这样）*/
-    m_mainLoop->addTask(channel, ElemType::ADD);
+    if (m_reusePort)
+    {
+        // 每个从反应堆各自监听和accept, 主反应堆只负责运行
+        setReusePortListen();
+    }
+    else
+    {
+        // 初始化监听
+        setListen();
+        // 初始化一个channel实例
+        /*Channel::handleFunc readFunc = accepConnection, Channel::handleFunc writeFunc=nullptr, Channel::handleFunc destroyFunc=nullptr*/
+        // m_lfd是setListen()中创建的监听用的socket的文件描述符，其对应的事件为FDEvent::ReadEvent
+        Channel* channel = new Channel(m_lfd, FDEvent::ReadEvent, acceptConnection, nullptr, nullptr, this);
+        // 完成模式下由反应堆提交ACCEPT请求, 读回调被调用时已经建立了连接
+        channel->setAcceptor(true);
+
+        // 添加channel到主反应堆的任务队列m_taskQ中
+        // channel中封装了监听用的socket的fd，它对应的事件类型FDEvent::ReadEvent，以及回调函数acceptConnection
+        /* 在反应堆中，反应堆会通过processTask()方法将m_taskQ中的channel取出并注册添加到select的位数组（事件监听表）中，
+         通过SelectDispatcher对象调用select方法对事件进行监听，当监听到事件的发生后，会根据事件的fd找到m_channelMap中对应的channel对象
+         根据channel对象中的events（事件类型）来选择调用处理函数，如果事件类型是ReadEvent则调用readFunc（这里添加的channel就是这样）*/
+        m_mainLoop->addTask(channel, ElemType::ADD);
+        m_listeners.push_back(make_pair(m_mainLoop, channel));
+    }
     // 启动反应堆模型
     m_mainLoop->run();
+    // 主反应堆退出之后不再处理信号, 恢复默认的处理方式, 等待子线程时再次收到信号会直接结束进程
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+    // 等待子线程中的连接处理完
+    m_threadPool->join();
+    CompressionCache::getInstance()->stop();
 }
+
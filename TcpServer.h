@@ -1,16 +1,65 @@
 #pragma once
 #include "EventLoop.h"
 #include "ThreadPool.h"
+#include <vector>
+using namespace std;
 
 class TcpServer
 {
 public:
-    TcpServer(unsigned short port, int threadNum); // 构造函数
+    // 构造函数，type是主、从反应堆使用的IO多路复用模型
+    TcpServer(unsigned short port, int threadNum, DispatcherType type = DispatcherType::EpollET);
+    // 需要在run()返回之后析构
+    ~TcpServer();
     // 初始化监听
     void setListen();
-    // 启动服务器
+    // 启动服务器, 收到SIGINT或SIGTERM并且所有的连接都断开、子线程都退出之后返回
     void run();
+    // 停止服务器: 不再接收新的连接, 正在处理的请求在timeoutMs毫秒内完成之后断开, 空闲的长连接立即断开
+    // 只能在主反应堆的线程中调用
+    void shutdown(int timeoutMs);
     static int acceptConnection(void* arg);
+    // 开启后每个子线程使用自己的SO_REUSEPORT监听socket, 由内核把连接分散到各个从反应堆, 需要在run()之前调用
+    inline void setReusePort(bool enable)
+    {
+        m_reusePort = enable;
+    }
+    // 设置连接的超时时长(ms): 接收请求头, 接收请求体和发送响应时的空闲, 长连接等待下一个请求
+    void setTimeouts(int headerMs, int bodyMs, int keepAliveMs);
+    // 主反应堆把新连接分配给子线程的策略, SO_REUSEPORT模式下由内核分配, 不使用
+    inline void setBalancePolicy(BalancePolicy policy)
+    {
+        m_threadPool->setBalancePolicy(policy);
+    }
+    // 绑定cpu: 主反应堆使用cpus[0], 第i个子线程使用cpus[(i + 1) % cpus.size()], 需要在run()之前调用
+    // 每个反应堆的连接内存池从它的cpu所在的NUMA节点上申请
+    void setCpuAffinity(const vector<int>& cpus);
+    // 开启后按SO_INCOMING_CPU把连接交给绑定在处理它的数据包的cpu上的子线程, 需要同时绑定cpu
+    inline void setIncomingCpu(bool enable)
+    {
+        m_incomingCpu = enable;
+    }
+    // 收到停止信号之后等待正在处理的请求的最长时间(ms)
+    inline void setShutdownTimeout(int timeoutMs)
+    {
+        m_shutdownTimeout = timeoutMs;
+    }
+
+private:
+    // 创建一个绑定到m_port的非阻塞监听fd, 失败返回-1
+    // incomingCpu不为-1时设置SO_INCOMING_CPU
+    int createListenFd(bool reusePort, int incomingCpu = -1);
+    // 为每个从反应堆创建一个SO_REUSEPORT监听fd, 并添加到从反应堆中
+    void setReusePortListen();
+    // 从非阻塞的lfd中取出一个连接, 没有待处理的连接时返回-1
+    // 完成模式下取出反应堆的ACCEPT请求建立的连接, 每次完成只有一个
+    static int acceptFd(int lfd, EventLoop* evLoop);
+    // SO_REUSEPORT模式下的读回调, 在从反应堆的线程中建立连接
+    static int acceptOnLoop(int lfd, EventLoop* evLoop);
+    // 屏蔽SIGINT和SIGTERM, 改为通过signalfd在主反应堆中处理, 需要在创建子线程之前调用
+    void setSignal();
+    // signalfd的读回调: 第一次收到信号时开始停止, 再次收到时立即断开所有的连接
+    static int processSignal(void* arg);
 
 private:
     int m_threadNum;
@@ -18,5 +67,13 @@ private:
     ThreadPool* m_threadPool; // 线程池
     int m_lfd;
     unsigned short m_port;
+    bool m_reusePort = false;
+    // 监听fd的channel和它所在的反应堆, 停止时从反应堆中删除
+    vector<pair<EventLoop*, Channel*>> m_listeners;
+    int m_signalFd = -1;
+    int m_shutdownTimeout = 30 * 1000;
+    bool m_isStopping = false;
+    vector<int> m_cpus;
+    bool m_incomingCpu = false;
 };
 
@@ -1,6 +1,13 @@
 #include "ThreadPool.h"
 #include <assert.h>
 #include <stdlib.h>
+#include <time.h>
+
+// 反应堆的负载: 一个连接计为1, 待发送的数据每256KB、每轮循环的处理时间每100us也各计为1
+static long loadScore(EventLoop* evLoop)
+{
+    return evLoop->getConnectionCount() + evLoop->getPendingBytes() / (256 * 1024) + evLoop->getBusyTime() / 100;
+}
 
 // 构造函数
 ThreadPool::ThreadPool(EventLoop* mainLoop, int count)
@@ -10,17 +17,37 @@ ThreadPool::ThreadPool(EventLoop* mainLoop, int count)
     m_mainLoop = mainLoop; // 由TcpServer传入，mainLoop是主反应堆（其m_taskQ中存放着任务队列）
     m_threadNum = count; // 线程的数量
     m_workerThreads.clear(); // m_workerThreads是一个vector<WorkerThread*>类型，其中存放工作线程的指针（子线程对象的指针）
+    m_policy = BalancePolicy::LeastLoaded;
+    m_random = (uint32_t)time(NULL) | 1;
 }
 
 // 析构函数
 ThreadPool::~ThreadPool()
 {
+    // 子线程还在运行时先让它们立即停止, 析构WorkerThread时会等待线程退出
+    shutdown(0);
     for (auto item : m_workerThreads)
     {
         delete item;
     }
 }
 
+void ThreadPool::shutdown(int timeoutMs)
+{
+    for (auto item : m_workerThreads)
+    {
+        item->getEventLoop()->shutdown(timeoutMs);
+    }
+}
+
+void ThreadPool::join()
+{
+    for (auto item : m_workerThreads)
+    {
+        item->join();
+    }
+}
+
 void ThreadPool::run()
 {
     assert(!m_isStart); // 如果m_isStart==true表示线程池已经启动，则assert
@@ -34,7 +61,9 @@ void ThreadPool::run()
     {
         for (int i = 0; i < m_threadNum; ++i)
         {
-            WorkerThread* subThread = new WorkerThread(i); // new一个新的工作线程对象，参数i标识线程对象的序号
+            // new一个新的工作线程对象，参数i标识线程对象的序号，从反应堆和主反应堆使用同一种IO多路复用模型
+            int cpu = i < (int)m_workerCpus.size() ? m_workerCpus[i] : -1;
+            WorkerThread* subThread = new WorkerThread(i, m_mainLoop->getDispatcherType(), cpu);
             subThread->run(); // run()中真正创建子线程，并执行子线程的工作函数
             /*WorkerThread对象中会创建一个子线程，子线程中会new一个新的EventLoop（从反应堆）对象，
             从反应堆running时会通过processTaskQ()从自己的m_taskQ任务队列中取出channel对象，将其封装的fd注册添加到监听事件表中。
@@ -47,7 +76,7 @@ void ThreadPool::run()
 }
 
 // 在channel的回调函数中被调用TcpServer::acceptConnection
-EventLoop* ThreadPool::takeWorkerEventLoop()
+EventLoop* ThreadPool::takeWorkerEventLoop(int cpu)
 {
     assert(m_isStart);
     if (m_mainLoop->getThreadID() != this_thread::get_id())
@@ -56,13 +85,61 @@ EventLoop* ThreadPool::takeWorkerEventLoop()
     }
     // 从线程池中找一个子线程, 然后取出里边的反应堆实例
     EventLoop* evLoop = m_mainLoop;
-    if (m_threadNum > 0)
+    if (cpu >= 0)
+    {
+        // 同一个cpu上可能绑定了多个子线程, 选择其中负载最小的
+        EventLoop* local = nullptr;
+        for (auto item : m_workerThreads)
+        {
+            if (item->getCpu() == cpu && (local == nullptr || loadScore(item->getEventLoop()) < loadScore(local)))
+            {
+                local = item->getEventLoop();
+            }
+        }
+        if (local != nullptr)
+        {
+            return local;
+        }
+    }
+    if (m_threadNum == 1)
+    {
+        evLoop = m_workerThreads[0]->getEventLoop();
+    }
+    else if (m_threadNum > 1 && m_policy == BalancePolicy::PowerOfTwo)
+    {
+        // xorshift32, 取两个不同的下标, 比较两个反应堆的负载
+        m_random ^= m_random << 13;
+        m_random ^= m_random >> 17;
+        m_random ^= m_random << 5;
+        int first = m_random % m_threadNum;
+        int second = (first + 1 + (m_random >> 16) % (m_threadNum - 1)) % m_threadNum;
+        EventLoop* a = m_workerThreads[first]->getEventLoop();
+        EventLoop* b = m_workerThreads[second]->getEventLoop();
+        evLoop = loadScore(b) < loadScore(a) ? b : a;
+    }
+    else if (m_threadNum > 1 && m_policy == BalancePolicy::LeastLoaded)
+    {
+        // 从m_index开始比较, 负载相同时轮流选择, 不会总是选中第一个
+        long minScore = -1;
+        for (int i = 0; i < m_threadNum; ++i)
+        {
+            EventLoop* item = m_workerThreads[(m_index + i) % m_threadNum]->getEventLoop();
+            long score = loadScore(item);
+            if (minScore == -1 || score < minScore)
+            {
+                minScore = score;
+                evLoop = item;
+            }
+        }
+        m_index = (m_index + 1) % m_threadNum;
+    }
+    else if (m_threadNum > 0)
     {
         // 按顺序从线程池的m_workerThreads（存储子线程对象的指针的vector）中取出一个子线程对象的指针WorkerThread
         // 从子线程对象中获得它的从反应堆实例的指针getEventLoop()
         evLoop = m_workerThreads[m_index]->getEventLoop();
         // m_index++
-        m_index = ++m_index % m_threadNum;
+        m_index = (m_index + 1) % m_threadNum;
     }
     // 返回拿到的子线程的反应堆对象的指针
     return evLoop;
@@ -3,8 +3,17 @@
 #include <stdbool.h>
 #include "WorkerThread.h"
 #include <vector>
+#include <stdint.h>
 using namespace std;
 
+// 新连接分配到哪个子线程的反应堆
+enum class BalancePolicy:char
+{
+    RoundRobin,     // 按顺序轮流分配
+    LeastLoaded,    // 选择负载最小的反应堆
+    PowerOfTwo      // 随机取两个反应堆, 选择其中负载较小的
+};
+
 // 定义线程池
 class ThreadPool
 {
@@ -13,8 +22,35 @@ public:
     ~ThreadPool();
     // 启动线程池
     void run();
-    // 取出线程池中的某个子线程的反应堆实例
-    EventLoop* takeWorkerEventLoop();
+    // 通知所有子线程的反应堆停止, 不等待, 参数见EventLoop::shutdown()
+    void shutdown(int timeoutMs);
+    // 等待所有的子线程退出
+    void join();
+    // 按m_policy取出线程池中的某个子线程的反应堆实例
+    // cpu不为-1时优先选择绑定在这个cpu上的子线程(连接的数据包由这个cpu处理), 没有时再按m_policy选择
+    EventLoop* takeWorkerEventLoop(int cpu = -1);
+    // 第i个子线程绑定到cpus[i]上, 需要在run()之前调用
+    inline void setWorkerCpus(const vector<int>& cpus)
+    {
+        m_workerCpus = cpus;
+    }
+    inline int getWorkerCpu(int index)
+    {
+        return m_workerThreads[index]->getCpu();
+    }
+    inline void setBalancePolicy(BalancePolicy policy)
+    {
+        m_policy = policy;
+    }
+    // 取出第index个子线程的反应堆实例
+    inline EventLoop* getWorkerEventLoop(int index)
+    {
+        return m_workerThreads[index]->getEventLoop();
+    }
+    inline int getThreadNum()
+    {
+        return m_threadNum;
+    }
 private:
     // 主线程的反应堆模型
     EventLoop* m_mainLoop; // 反应堆
@@ -22,5 +58,8 @@ private:
     int m_threadNum;
     vector<WorkerThread*> m_workerThreads;
     int m_index;
+    BalancePolicy m_policy;
+    vector<int> m_workerCpus;
+    uint32_t m_random; // PowerOfTwo使用的随机数状态, 只在主线程中访问
 };
 
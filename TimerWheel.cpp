@@ -0,0 +1,229 @@
+#include "TimerWheel.h"
+#include <time.h>
+#include <string.h>
+
+TimerWheel::TimerWheel()
+{
+    for (TimerNode& slot : m_slots)
+    {
+        slot.prev = slot.next = &slot;
+    }
+    memset(m_rootBits, 0, sizeof(m_rootBits));
+    m_current = nowMs() / TickMs;
+}
+
+uint64_t TimerWheel::nowMs()
+{
+    // 单调时钟不受修改系统时间的影响, 通过vDSO读取, 不需要陷入内核
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void TimerWheel::add(Timer* timer, int timeoutMs)
+{
+    if (timer->isActive())
+    {
+        remove(timer);
+    }
+    // 按tick向上取整
+    timer->expire = (nowMs() + timeoutMs + TickMs - 1) / TickMs;
+    place(timer);
+    ++m_count;
+}
+
+void TimerWheel::place(Timer* timer)
+{
+    // 已经过期的定时器在下一次处理时触发
+    if (timer->expire < m_current)
+    {
+        timer->expire = m_current;
+    }
+    uint64_t delta = timer->expire - m_current;
+    int slot;
+    if (delta < RootSize)
+    {
+        slot = timer->expire & (RootSize - 1);
+        m_rootBits[slot >> 6] |= 1ULL << (slot & 63);
+    }
+    else
+    {
+        int level = 1;
+        int shift = RootBits;
+        while (level < LevelCount - 1 && delta >= (1ULL << (shift + LevelBits)))
+        {
+            ++level;
+            shift += LevelBits;
+        }
+        // 超出最高层范围的定时器放在最高层最远的槽中, 到时候再重新分配
+        if (delta >= (1ULL << (shift + LevelBits)))
+        {
+            timer->expire = m_current + (1ULL << (shift + LevelBits)) - 1;
+        }
+        slot = RootSize + (level - 1) * LevelSize + ((timer->expire >> shift) & (LevelSize - 1));
+    }
+    timer->slot = slot;
+    TimerNode* head = &m_slots[slot];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void TimerWheel::remove(Timer* timer)
+{
+    if (!timer->isActive())
+    {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = nullptr;
+    int slot = timer->slot;
+    if (slot >= 0 && slot < RootSize && m_slots[slot].next == &m_slots[slot])
+    {
+        m_rootBits[slot >> 6] &= ~(1ULL << (slot & 63));
+    }
+    timer->slot = -1;
+    --m_count;
+}
+
+void TimerWheel::cascade(int level)
+{
+    int shift = RootBits + (level - 1) * LevelBits;
+    int index = (m_current >> shift) & (LevelSize - 1);
+    // 上一层转到了新的一圈, 先把更上一层的定时器分配下来
+    if (index == 0 && level < LevelCount - 1)
+    {
+        cascade(level + 1);
+    }
+    TimerNode* head = &m_slots[RootSize + (level - 1) * LevelSize + index];
+    TimerNode list;
+    if (head->next == head)
+    {
+        return;
+    }
+    // 整个链表取下来之后逐个重新放置, 它们现在距离触发都不到一圈了
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    head->prev = head->next = head;
+    while (list.next != &list)
+    {
+        Timer* timer = static_cast<Timer*>(list.next);
+        list.next = timer->next;
+        timer->next->prev = &list;
+        place(timer);
+    }
+}
+
+int TimerWheel::findRootSlot(int index)
+{
+    for (int word = index >> 6; word < RootSize / 64; ++word)
+    {
+        uint64_t bits = m_rootBits[word];
+        if (word == index >> 6)
+        {
+            bits &= ~0ULL << (index & 63);
+        }
+        if (bits != 0)
+        {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return RootSize;
+}
+
+void TimerWheel::expireAll()
+{
+    // 先把所有槽中的定时器都移到一个链表中, 再逐个触发
+    TimerNode list;
+    list.prev = list.next = &list;
+    for (int slot = 0; slot < SlotCount; ++slot)
+    {
+        TimerNode* head = &m_slots[slot];
+        if (head->next == head)
+        {
+            continue;
+        }
+        head->next->prev = list.prev;
+        list.prev->next = head->next;
+        head->prev->next = &list;
+        list.prev = head->prev;
+        head->prev = head->next = head;
+    }
+    for (uint64_t& bits : m_rootBits)
+    {
+        bits = 0;
+    }
+    while (list.next != &list)
+    {
+        Timer* timer = static_cast<Timer*>(list.next);
+        remove(timer);
+        timer->callback(timer->arg);
+    }
+}
+
+int TimerWheel::getTimeout()
+{
+    if (m_count == 0)
+    {
+        return -1;
+    }
+    // 第0层后面的槽都是空的时, 在这一圈结束的时候醒来把上层的定时器分配下来
+    int index = m_current & (RootSize - 1);
+    uint64_t next = m_current - index + findRootSlot(index);
+    uint64_t now = nowMs();
+    if (next * TickMs <= now)
+    {
+        return 0;
+    }
+    return next * TickMs - now;
+}
+
+void TimerWheel::expire()
+{
+    uint64_t target = nowMs() / TickMs;
+    while (m_current <= target && m_count > 0)
+    {
+        int index = m_current & (RootSize - 1);
+        if (index == 0)
+        {
+            cascade(1);
+        }
+        // 跳过空的槽, 长时间没有处理时也不需要逐个tick检查
+        int slot = findRootSlot(index);
+        uint64_t tick = m_current - index + slot;
+        if (tick > target)
+        {
+            break;
+        }
+        m_current = tick;
+        if (slot == RootSize)
+        {
+            // 第0层这一圈剩下的槽都是空的, 直接转到下一圈
+            continue;
+        }
+        // 先把到期的链表整个取下来并移动到下一个tick, 回调中添加的定时器不会被这一轮处理
+        TimerNode* head = &m_slots[slot];
+        TimerNode list;
+        list.next = head->next;
+        list.prev = head->prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        head->prev = head->next = head;
+        m_rootBits[slot >> 6] &= ~(1ULL << (slot & 63));
+        ++m_current;
+        while (list.next != &list)
+        {
+            Timer* timer = static_cast<Timer*>(list.next);
+            remove(timer);
+            timer->callback(timer->arg);
+        }
+    }
+    if (m_current <= target)
+    {
+        m_current = target + 1;
+    }
+}
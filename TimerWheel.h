@@ -0,0 +1,79 @@
+#pragma once
+#include <functional>
+#include <stdint.h>
+using namespace std;
+
+// 侵入式双向链表的节点, 时间轮的每个槽是一个带哨兵的环形链表
+struct TimerNode
+{
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+};
+
+// 定时器由使用者持有(例如作为TcpConnection的成员), 添加和删除都不需要申请内存
+struct Timer : TimerNode
+{
+    using handleFunc = function<int(void*)>;
+    Timer() = default;
+    Timer(handleFunc func, void* arg) : callback(func), arg(arg) {}
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+    // 是否在时间轮中等待触发
+    inline bool isActive()
+    {
+        return prev != nullptr;
+    }
+    handleFunc callback;
+    void* arg = nullptr;
+    uint64_t expire = 0;    // 触发的时刻, 单位是tick
+    int16_t slot = -1;      // 所在的槽在m_slots中的下标
+};
+
+// 分层的时间轮, 每个EventLoop一个, 只在反应堆的线程中使用, 不加锁
+// 第0层256个槽, 每个槽一个tick; 之后每层64个槽, 每个槽的跨度是下一层的一圈
+// 添加、删除都是O(1), 第0层转完一圈时把上一层对应的槽中的定时器重新分配到下层
+class TimerWheel
+{
+public:
+    static const int TickMs = 10;   // 一个tick的毫秒数
+    static const int RootBits = 8;
+    static const int LevelBits = 6;
+    static const int LevelCount = 4;
+    static const int RootSize = 1 << RootBits;
+    static const int LevelSize = 1 << LevelBits;
+    static const int SlotCount = RootSize + (LevelCount - 1) * LevelSize;
+
+    TimerWheel();
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+    // timeoutMs毫秒之后调用timer的回调函数, timer已经在时间轮中时重新计时
+    void add(Timer* timer, int timeoutMs);
+    // 删除定时器, 不在时间轮中时什么都不做
+    void remove(Timer* timer);
+    // 距离下一个定时器触发还有多少毫秒, 没有定时器时返回-1, 作为dispatch的超时时长
+    int getTimeout();
+    // 触发所有已经到期的定时器
+    void expire();
+    // 不管是否到期, 立即触发所有的定时器, 回调中重新添加的定时器不会被这一轮触发
+    void expireAll();
+    inline int getCount()
+    {
+        return m_count;
+    }
+    // 单调时钟的当前时刻, 单位是ms
+    static uint64_t nowMs();
+
+private:
+    // 按触发时刻放到对应层的槽中
+    void place(Timer* timer);
+    // 把第level层当前的槽中的定时器重新分配到下层
+    void cascade(int level);
+    // 第0层从index开始第一个非空的槽, 都是空的返回RootSize
+    int findRootSlot(int index);
+
+private:
+    TimerNode m_slots[SlotCount];
+    uint64_t m_rootBits[RootSize / 64]; // 第0层哪些槽不为空
+    uint64_t m_current;     // 下一个需要处理的tick
+    int m_count = 0;
+};
@@ -1,11 +1,40 @@
 #include "WorkerThread.h"
 #include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+int WorkerThread::bindCpu(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0)
+    {
+        errno = ret;
+        perror("pthread_setaffinity_np");
+        return -1;
+    }
+    // 返回时线程已经迁移到了这个cpu上, getcpu得到的就是它所在的节点
+    unsigned int curCpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &curCpu, &node, NULL) == -1)
+    {
+        return -1;
+    }
+    return node;
+}
 
 // 子线程的回调函数，即子线程要执行的函数
 void WorkerThread::running()
 {
+    // 先绑定cpu再创建反应堆, 反应堆的内存在第一次访问时分配在这个cpu所在的NUMA节点上
+    int node = m_cpu >= 0 ? bindCpu(m_cpu) : -1;
     m_mutex.lock();
-    m_evLoop = new EventLoop(m_name); // new一个新的反应堆实例，该反应堆为从反应堆，其属于子线程
+    m_evLoop = new EventLoop(m_name, m_dispatcherType); // new一个新的反应堆实例，该反应堆为从反应堆，其属于子线程
+    m_evLoop->setNumaNode(node);
     m_mutex.unlock();
     m_cond.notify_one(); // 唤醒阻塞在这个条件变量m_cond上的某1个线程
     m_evLoop->run(); // 启动从反应堆
@@ -15,20 +44,37 @@ void WorkerThread::running()
 WorkerThread类对象在TreadPool::run()中被创建，一个WorkerThread类对象就对应着一个子线程
 子线程在WorkerThread::run()中通过调用c++的std::thread类方法创建
 */
-WorkerThread::WorkerThread(int index)
+WorkerThread::WorkerThread(int index, DispatcherType type, int cpu)
 {
     m_evLoop = nullptr; // WorkerThread对象所属的从反应堆对象的指针
     m_thread = nullptr; // m_thread是个std:thread*类型的指针，它指向一个thread对象
     m_threadID = thread::id(); // C++11中的ID不是一个整型，不能直接用0对其进行初始化，需要调用thread::id()对其进行初始化（返回一个无效的ID）
     m_name =  "SubThread-" + to_string(index);
+    m_dispatcherType = type;
+    m_cpu = cpu;
 }
 
 WorkerThread::~WorkerThread()
 {
     if (m_thread != nullptr)
     {
+        // 线程还在运行时析构thread对象会调用terminate(), 反应堆要在线程退出之后才能释放
+        if (m_evLoop != nullptr && m_thread->joinable())
+        {
+            m_evLoop->shutdown(0);
+        }
+        join();
         delete m_thread;
     }
+    delete m_evLoop;
+}
+
+void WorkerThread::join()
+{
+    if (m_thread != nullptr && m_thread->joinable())
+    {
+        m_thread->join();
+    }
 }
 
 void WorkerThread::run()
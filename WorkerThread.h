@@ -9,13 +9,21 @@ using namespace std;
 class WorkerThread
 {
 public:
-    WorkerThread(int index); // 构造函数，index表示当前线程是线程池中的第几个
+    // 构造函数，index表示当前线程是线程池中的第几个，type是从反应堆的IO多路复用模型，cpu为-1时不绑定cpu
+    WorkerThread(int index, DispatcherType type, int cpu = -1);
     ~WorkerThread(); // 析构函数
     void run(); // 启动线程
+    void join(); // 等待线程退出, 需要先调用反应堆的shutdown()
     inline EventLoop* getEventLoop()
     {
         return m_evLoop;
     }
+    inline int getCpu()
+    {
+        return m_cpu;
+    }
+    // 把调用这个函数的线程绑定到cpu上, 返回cpu所在的NUMA节点, 失败返回-1
+    static int bindCpu(int cpu);
 
 private:
     void running();
@@ -27,5 +35,7 @@ private:
     mutex m_mutex;  // 互斥锁
     condition_variable m_cond; // 条件变量
     EventLoop* m_evLoop; // 反应堆模型
+    DispatcherType m_dispatcherType; // 从反应堆使用的IO多路复用模型
+    int m_cpu; // 子线程绑定的cpu
 };
 
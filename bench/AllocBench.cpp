@@ -0,0 +1,233 @@
+// 请求处理路径的内存分配计数和耗时测试
+// 重复解析并处理同一个请求(不经过socket), 统计预热之后每个请求调用malloc的次数和平均耗时
+// 这些GET请求在预热之后都应该是0次分配, 否则返回1, 可以作为回归测试使用
+// 另外通过socketpair测量新连接: 从内存池创建TcpConnection, 处理第一个请求, 然后释放, 也应该是0次分配
+//
+// 编译(在项目根目录): g++ -std=c++17 -O2 bench/AllocBench.cpp $(ls *.cpp | grep -v main.cpp) -I. -o alloc_bench -lpthread -lz
+// 运行: ./alloc_bench [文档根目录, 默认为source] [每种请求的次数, 默认为200000]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <atomic>
+#include "Buffer.h"
+#include "EventLoop.h"
+#include "FileCache.h"
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+#include "TcpConnection.h"
+
+// glibc中真正的分配函数, 这里定义的malloc等函数统计次数之后转交给它们
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t align, size_t size);
+extern "C" void __libc_free(void* ptr);
+
+// 只统计测量期间的分配, operator new最终也会调用malloc
+static atomic<bool> g_counting{ false };
+static atomic<long> g_allocCount{ 0 };
+
+extern "C" void* malloc(size_t size)
+{
+    if (g_counting.load(memory_order_relaxed))
+    {
+        g_allocCount.fetch_add(1, memory_order_relaxed);
+    }
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+    if (g_counting.load(memory_order_relaxed))
+    {
+        g_allocCount.fetch_add(1, memory_order_relaxed);
+    }
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+    if (g_counting.load(memory_order_relaxed))
+    {
+        g_allocCount.fetch_add(1, memory_order_relaxed);
+    }
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void* memalign(size_t align, size_t size)
+{
+    if (g_counting.load(memory_order_relaxed))
+    {
+        g_allocCount.fetch_add(1, memory_order_relaxed);
+    }
+    return __libc_memalign(align, size);
+}
+
+extern "C" void free(void* ptr)
+{
+    __libc_free(ptr);
+}
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct BenchCase
+{
+    const char* name;
+    const char* request;
+};
+
+// 处理一个请求: 复制到读缓冲区, 解析并生成响应, 然后像发送完一样丢弃响应
+static bool runOnce(HttpRequest& request, HttpResponse& response, Buffer& readBuf, Buffer& writeBuf,
+    const char* data, int size)
+{
+    readBuf.appendString(data, size);
+    bool ok = request.parseHttpRequest(&readBuf, &response, &writeBuf) &&
+        request.getState() == PrecessState::ParseReqDone;
+    writeBuf.readPosIncrease(writeBuf.readableSize());
+    response.reset();
+    request.reset();
+    return ok;
+}
+
+// 模拟一次accept: 创建连接, 客户端发送一个请求, 读完响应之后断开, 返回是否收到了响应
+static bool runConnection(EventLoop* evLoop, const char* data, int size)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == -1)
+    {
+        perror("socketpair");
+        return false;
+    }
+    // 当前线程就是evLoop的线程, channel会被直接添加到dispatcher中
+    TcpConnection* conn = TcpConnection::create(fds[0], evLoop);
+    bool ok = conn != nullptr && write(fds[1], data, size) == size;
+    if (ok)
+    {
+        TcpConnection::processRead(conn);
+        char buf[4096];
+        ok = read(fds[1], buf, sizeof(buf)) > 0;
+        while (read(fds[1], buf, sizeof(buf)) > 0)
+        {
+        }
+    }
+    if (conn != nullptr)
+    {
+        TcpConnection::destroy(conn);
+    }
+    close(fds[1]);
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* root = argc > 1 ? argv[1] : "source";
+    long iterations = argc > 2 ? atol(argv[2]) : 200000;
+    if (chdir(root) == -1)
+    {
+        perror("chdir");
+        return 1;
+    }
+    // 和服务器一样监视文档根目录, 这样才会使用文件元数据和内容的缓存
+    EventLoop* evLoop = new EventLoop();
+    FileCache::getInstance()->watch(evLoop, ".");
+
+    // 典型的浏览器请求, 带有常见的请求头
+    static const char browserHeaders[] =
+        "Host: localhost:10000\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Language: zh-CN,zh;q=0.8,en-US;q=0.5,en;q=0.3\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Connection: keep-alive\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "Sec-Fetch-Dest: document\r\n"
+        "Sec-Fetch-Mode: navigate\r\n";
+    string fileGet = string("GET /favicon.ico HTTP/1.1\r\n") + browserHeaders + "\r\n";
+    string dirGet = string("GET / HTTP/1.1\r\n") + browserHeaders + "\r\n";
+    string notFound = string("GET /no-such-file.html HTTP/1.1\r\n") + browserHeaders + "\r\n";
+    string range = string("GET /favicon.ico HTTP/1.1\r\n") + browserHeaders + "Range: bytes=0-99\r\n\r\n";
+    string query = string("GET /favicon.ico?v=%31%32 HTTP/1.1\r\n") + browserHeaders + "\r\n";
+    BenchCase cases[] = {
+        { "GET cached file", fileGet.c_str() },
+        { "GET with query", query.c_str() },
+        { "GET range", range.c_str() },
+        { "GET directory", dirGet.c_str() },
+        { "GET 404", notFound.c_str() },
+    };
+
+    HttpRequest request;
+    HttpResponse response;
+    Buffer readBuf(10240);
+    Buffer writeBuf(10240);
+    bool passed = true;
+    printf("%-18s %12s %14s\n", "case", "ns/request", "allocs/request");
+    for (BenchCase& item : cases)
+    {
+        int size = strlen(item.request);
+        // 预热: 填充缓存, 让缓冲区和成员字符串达到稳定的容量
+        for (int i = 0; i < 100; ++i)
+        {
+            if (!runOnce(request, response, readBuf, writeBuf, item.request, size))
+            {
+                printf("%s: request failed\n", item.name);
+                return 1;
+            }
+        }
+        g_allocCount = 0;
+        g_counting = true;
+        uint64_t start = nowNs();
+        for (long i = 0; i < iterations; ++i)
+        {
+            runOnce(request, response, readBuf, writeBuf, item.request, size);
+        }
+        uint64_t elapsed = nowNs() - start;
+        g_counting = false;
+        double allocs = (double)g_allocCount.load() / iterations;
+        printf("%-18s %12.0f %14.2f\n", item.name, (double)elapsed / iterations, allocs);
+        if (g_allocCount.load() != 0)
+        {
+            passed = false;
+        }
+    }
+    // 新连接: 连接对象、缓冲区、请求头和响应片段都在内存池的内存块中, 不需要申请内存
+    {
+        const char* data = fileGet.c_str();
+        int size = fileGet.size();
+        long connections = iterations / 10;
+        for (int i = 0; i < 100; ++i)
+        {
+            if (!runConnection(evLoop, data, size))
+            {
+                printf("new connection: request failed\n");
+                return 1;
+            }
+        }
+        g_allocCount = 0;
+        g_counting = true;
+        uint64_t start = nowNs();
+        for (long i = 0; i < connections; ++i)
+        {
+            runConnection(evLoop, data, size);
+        }
+        uint64_t elapsed = nowNs() - start;
+        g_counting = false;
+        double allocs = (double)g_allocCount.load() / connections;
+        printf("%-18s %12.0f %14.2f\n", "new connection", (double)elapsed / connections, allocs);
+        if (g_allocCount.load() != 0)
+        {
+            passed = false;
+        }
+    }
+    delete evLoop;
+    printf(passed ? "PASS: GET requests and new connections do not allocate\n" : "FAIL: GET requests or new connections allocate memory\n");
+    return passed ? 0 : 1;
+}
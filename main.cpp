@@ -1,26 +1,164 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <vector>
 #include "TcpServer.h"
+#include "MimeTypes.h"
+#include "FileCache.h"
+#include "ContentCache.h"
+#include "CompressionCache.h"
+
+// 根据名字选择反应堆使用的IO多路复用模型: select | poll | epoll | epoll-et | io_uring
+static DispatcherType parseDispatcherType(const char* name)
+{
+    if (strcmp(name, "select") == 0)
+        return DispatcherType::Select;
+    if (strcmp(name, "poll") == 0)
+        return DispatcherType::Poll;
+    if (strcmp(name, "epoll") == 0)
+        return DispatcherType::Epoll;
+    if (strcmp(name, "io_uring") == 0)
+        return DispatcherType::IoUring;
+    return DispatcherType::EpollET;
+}
+
+// 根据名字选择分配新连接的策略: rr | least | p2c
+static BalancePolicy parseBalancePolicy(const char* name)
+{
+    if (strcmp(name, "rr") == 0)
+        return BalancePolicy::RoundRobin;
+    if (strcmp(name, "p2c") == 0)
+        return BalancePolicy::PowerOfTwo;
+    return BalancePolicy::LeastLoaded;
+}
+
+// 解析cpu列表: auto表示进程可以使用的全部cpu, 否则是逗号分隔的cpu编号
+static vector<int> parseCpuList(const char* list)
+{
+    vector<int> cpus;
+    if (strcmp(list, "auto") == 0)
+    {
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            {
+                if (CPU_ISSET(cpu, &set))
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        return cpus;
+    }
+    for (const char* p = list; *p != '\0'; )
+    {
+        char* end = nullptr;
+        long cpu = strtol(p, &end, 10);
+        if (end == p)
+        {
+            break;
+        }
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+        {
+            cpus.push_back(cpu);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return cpus;
+}
 
 int main(int argc, char* argv[])
 {
 #if 0
     if (argc < 3)
     {
-        printf("./a.out port path\n");
+        printf("./a.out port path [select|poll|epoll|epoll-et|io_uring] [reuseport] [mime=file] [timeout=header,body,keepalive] [shutdown=seconds] [balance=rr|least|p2c] [cpus=auto|0,1,...] [incomingcpu] [cache=bytes] [gzcache=bytes] [filecache=entries]\n");
         return -1;
     }
     unsigned short port = atoi(argv[1]);
     // 切换服务器的工作路径
     chdir(argv[2]);
+    int optIndex = 3;
 #else
     unsigned short port = 10000;
     chdir("./source");
+    // ./server [select|poll|epoll|epoll-et] [reuseport] [mime=文件] [timeout=请求头,请求体,长连接(秒)] [shutdown=停止时等待请求完成的秒数] [balance=rr|least|p2c]
+    //          [cpus=auto|绑定的cpu列表] [incomingcpu] [cache=文件内容缓存的字节数] [gzcache=压缩结果缓存的字节数]
+    //          [filecache=缓存的路径个数]
+    int optIndex = 1;
 #endif
+    // 默认使用边沿触发的epoll, 由主反应堆accept连接
+    DispatcherType type = DispatcherType::EpollET;
+    bool reusePort = false;
+    // 超时时长, 单位: 秒
+    int headerTimeout = 15, bodyTimeout = 30, keepAliveTimeout = 60;
+    int shutdownTimeout = 30;
+    BalancePolicy policy = BalancePolicy::LeastLoaded;
+    vector<int> cpus;
+    bool incomingCpu = false;
+    for (int i = optIndex; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "reuseport") == 0)
+        {
+            reusePort = true;
+        }
+        else if (strncmp(argv[i], "mime=", 5) == 0)
+        {
+            // 额外的MIME类型需要在工作线程启动之前加载
+            MimeTypes::loadFile(argv[i] + 5);
+        }
+        else if (strncmp(argv[i], "timeout=", 8) == 0)
+        {
+            sscanf(argv[i] + 8, "%d,%d,%d", &headerTimeout, &bodyTimeout, &keepAliveTimeout);
+        }
+        else if (strncmp(argv[i], "shutdown=", 9) == 0)
+        {
+            shutdownTimeout = atoi(argv[i] + 9);
+        }
+        else if (strncmp(argv[i], "balance=", 8) == 0)
+        {
+            policy = parseBalancePolicy(argv[i] + 8);
+        }
+        else if (strncmp(argv[i], "cpus=", 5) == 0)
+        {
+            cpus = parseCpuList(argv[i] + 5);
+        }
+        else if (strcmp(argv[i], "incomingcpu") == 0)
+        {
+            incomingCpu = true;
+        }
+        else if (strncmp(argv[i], "cache=", 6) == 0)
+        {
+            // 缓存的容量需要在工作线程启动之前设置, 0表示不缓存
+            ContentCache::getInstance()->setCapacity(strtoull(argv[i] + 6, nullptr, 10));
+        }
+        else if (strncmp(argv[i], "gzcache=", 8) == 0)
+        {
+            CompressionCache::getInstance()->setCapacity(strtoull(argv[i] + 8, nullptr, 10));
+        }
+        else if (strncmp(argv[i], "filecache=", 10) == 0)
+        {
+            FileCache::getInstance()->setMaxEntries(strtoull(argv[i] + 10, nullptr, 10));
+        }
+        else
+        {
+            type = parseDispatcherType(argv[i]);
+        }
+    }
     // 启动服务器
-    TcpServer* server = new TcpServer(port, 4);
+    TcpServer* server = new TcpServer(port, 4, type);
+    server->setReusePort(reusePort);
+    server->setTimeouts(headerTimeout * 1000, bodyTimeout * 1000, keepAliveTimeout * 1000);
+    server->setShutdownTimeout(shutdownTimeout * 1000);
+    server->setBalancePolicy(policy);
+    server->setCpuAffinity(cpus);
+    server->setIncomingCpu(incomingCpu && !cpus.empty());
+    // 收到SIGINT或SIGTERM并且所有的连接都处理完之后返回
     server->run();
+    delete server;
 
     return 0;
-}
\ No newline at end of file
+}